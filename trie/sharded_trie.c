@@ -0,0 +1,698 @@
+/*
+ * Copyright © 2016 Ashutosh Grewal. All rights reserved.
+ *
+ * @file sharded_trie.c
+ * @brief This file implements a trie split into shards by the first character of the key.
+ * @details
+ * The root of a trie already splits the keys by their first character. A sharded trie
+ * turns each of those subtrees into a trie of its own, a shard, with its own lock, node
+ * allocator and counters, so threads working on keys that start with different
+ * characters never touch the same lock or memory. Lookups share the lock of a shard
+ * while adds and deletes take it exclusively. The empty key is kept in the first shard.
+ *
+ * A batch of adds or lookups is sorted by shard and handed to a pool of worker threads
+ * (the calling thread being one of them). Each thread takes one shard at a time and does
+ * all the work of the batch for that shard under a single acquisition of its lock.
+ *
+ * @author Ashutosh Grewal on 12/10/16.
+ *
+ * @bug No bugs are know at this point.
+ */
+
+#define _POSIX_C_SOURCE 200809L     /**< Read-write locks are POSIX, not ISO C. */
+#define _DARWIN_C_SOURCE            /**< Keeps _SC_NPROCESSORS_ONLN visible on macOS. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sharded_trie.h"
+
+#define MAX_NUM_SHARDS 256              /**< One shard per byte value at most. */
+#define INVALID_SHARD MAX_NUM_SHARDS    /**< Shard of characters not permitted in a key. */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * @brief Enum representing the work a batch does on each shard.
+ */
+typedef enum shard_job_type_e {
+    SHARD_JOB_ADD,
+    SHARD_JOB_LOOKUP,
+    SHARD_JOB_DESTROY
+} shard_job_type_t;
+
+/**
+ * @brief A trie holding the keys that start with one character.
+ */
+typedef struct shard_s {
+    trie_t *trie;                            /**< Keys of the shard. */
+    pthread_rwlock_t lock;                   /**< Shared by lookups, exclusive for
+                                                  adds and deletes. */
+    sharded_trie_stats_t stats;              /**< Counters, updated atomically. */
+    char padding[CACHE_LINE_SIZE];           /**< Keeps neighbouring shards off each
+                                                  other's cache lines. */
+} shard_t;
+
+/**
+ * @brief A batch being worked on by the threads of a sharded trie.
+ */
+typedef struct shard_job_s {
+    shard_job_type_t type;                   /**< What is done on each shard. */
+    const char **keys;                       /**< Keys of the batch sorted by shard. */
+    size_t *sizes;                           /**< Sizes of the keys. */
+    int *values;                             /**< Values of the keys. */
+    boolean *found;                          /**< Whether a lookup found a value. */
+    size_t *start;                           /**< The keys of shard i are keys[start[i]]
+                                                  up to keys[start[i + 1]]. */
+    size_t next_shard;                       /**< Next shard to be taken by a thread. */
+    boolean failed;                          /**< Whether some key was not added. */
+} shard_job_t;
+
+/**
+ * @brief Definition of the sharded trie.
+ */
+struct sharded_trie_s {
+    shard_t *shards;                         /**< The shards, one per character. */
+    size_t num_shards;                       /**< Number of shards. */
+    unsigned short char_to_shard[MAX_NUM_SHARDS];
+                                             /**< Shard of the keys starting with a
+                                                  character, or INVALID_SHARD. */
+    pthread_t *threads;                      /**< Worker threads. */
+    unsigned int num_threads;                /**< Number of worker threads, not
+                                                  counting the caller of a batch. */
+    pthread_mutex_t dispatch_lock;           /**< One batch is worked on at a time. */
+    pthread_mutex_t lock;                    /**< Protects the fields below. */
+    pthread_cond_t work_cond;                /**< Signalled when a batch comes in. */
+    pthread_cond_t done_cond;                /**< Signalled when the workers are done. */
+    shard_job_t *job;                        /**< The batch being worked on. */
+    unsigned long generation;                /**< Number of batches handed out. */
+    unsigned int num_busy;                   /**< Workers still on the batch. */
+    boolean shutdown;                        /**< Whether the workers should exit. */
+};
+
+static shard_t *key_shard (sharded_trie_t *strie, const char *key, size_t size_of_key);
+static boolean sort_batch (sharded_trie_t *strie, shard_job_t *job, const char **keys,
+                           const size_t *sizes, const int *values, size_t num_keys,
+                           size_t **order);
+static void free_batch (shard_job_t *job, size_t *order);
+static void run_job (sharded_trie_t *strie, shard_job_t *job);
+static void dispatch_job (sharded_trie_t *strie, shard_job_t *job);
+static void *shard_worker (void *arg);
+static void stop_workers (sharded_trie_t *strie);
+
+/**
+ * @brief Create a sharded trie.
+ *
+ * @details
+ * There is a shard per character of the alphabet, each of them a trie with its
+ * own arena (see create_trie_with_alphabet). The worker threads used for batches
+ * are started right away and wait for work until the trie is destroyed.
+ *
+ * @param[in] alphabet The characters permitted in keys with no duplicates, or
+ *            TRIE_ALPHABET_BYTES for all 256 byte values.
+ * @param[in] num_threads Number of threads working on a batch, including the
+ *            caller, or 0 for as many as there are processors online.
+ *
+ * @return Pointer to the sharded trie or NULL if memory allocation failed, a
+ * thread could not be started or the alphabet is not valid.
+ */
+sharded_trie_t *create_sharded_trie (const char *alphabet, unsigned int num_threads)
+{
+    sharded_trie_t *strie;
+    size_t num_shards;
+    long num_cpus;
+    size_t i;
+    
+    strie = (sharded_trie_t *) calloc (1, sizeof(sharded_trie_t));
+    if (!strie) {
+        return NULL;
+    }
+    pthread_mutex_init(&strie->dispatch_lock, NULL);
+    pthread_mutex_init(&strie->lock, NULL);
+    pthread_cond_init(&strie->work_cond, NULL);
+    pthread_cond_init(&strie->done_cond, NULL);
+    for (i = 0; i < MAX_NUM_SHARDS; i++) {
+        strie->char_to_shard[i] = alphabet ? INVALID_SHARD : i;
+    }
+    num_shards = MAX_NUM_SHARDS;
+    if (alphabet) {
+        for (num_shards = 0; alphabet[num_shards]; num_shards++) {
+            if (strie->char_to_shard[(unsigned char)alphabet[num_shards]] != INVALID_SHARD) {
+                goto error_handling;
+            }
+            strie->char_to_shard[(unsigned char)alphabet[num_shards]] = num_shards;
+        }
+        if (!num_shards) {
+            goto error_handling;
+        }
+    }
+    
+    strie->shards = (shard_t *) calloc (num_shards, sizeof(shard_t));
+    if (!strie->shards) {
+        goto error_handling;
+    }
+    for (; strie->num_shards < num_shards; strie->num_shards++) {
+        strie->shards[strie->num_shards].trie = create_trie_with_alphabet(alphabet, TRUE);
+        if (!strie->shards[strie->num_shards].trie) {
+            goto error_handling;
+        }
+        if (pthread_rwlock_init(&strie->shards[strie->num_shards].lock, NULL)) {
+            destroy_trie(strie->shards[strie->num_shards].trie);
+            goto error_handling;
+        }
+    }
+    
+    if (!num_threads) {
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_cpus > 0) ? (unsigned int)num_cpus : 1;
+    }
+    if (num_threads > num_shards) {
+        num_threads = (unsigned int)num_shards;
+    }
+    strie->threads = (pthread_t *) malloc (sizeof(pthread_t) * num_threads);
+    if (!strie->threads) {
+        goto error_handling;
+    }
+    for (; strie->num_threads < num_threads - 1; strie->num_threads++) {
+        if (pthread_create(&strie->threads[strie->num_threads], NULL, shard_worker, strie)) {
+            goto error_handling;
+        }
+    }
+    
+    return strie;
+    
+error_handling:
+    stop_workers(strie);
+    for (i = 0; i < strie->num_shards; i++) {
+        destroy_trie(strie->shards[i].trie);
+        pthread_rwlock_destroy(&strie->shards[i].lock);
+    }
+    free(strie->shards);
+    free(strie);
+    
+    return NULL;
+}
+
+/**
+ * @brief Destroy a sharded trie along with all its keys.
+ *
+ * @details
+ * The shards are destroyed in parallel by the worker threads, which then exit.
+ * No other call on the trie may be in progress.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ */
+void destroy_sharded_trie (sharded_trie_t *strie)
+{
+    shard_job_t job;
+    size_t i;
+    
+    memset(&job, 0, sizeof(job));
+    job.type = SHARD_JOB_DESTROY;
+    dispatch_job(strie, &job);
+    stop_workers(strie);
+    for (i = 0; i < strie->num_shards; i++) {
+        pthread_rwlock_destroy(&strie->shards[i].lock);
+    }
+    free(strie->shards);
+    free(strie);
+}
+
+/**
+ * @brief Add a value with a key to a sharded trie.
+ *
+ * @details
+ * Only the shard of the key is locked, so adds of keys starting with different
+ * characters proceed in parallel.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] key The key provided to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+boolean add_to_sharded_trie (sharded_trie_t *strie, const char *key, size_t size_of_key,
+                             int value)
+{
+    shard_t *shard;
+    boolean result;
+    
+    shard = key_shard(strie, key, size_of_key);
+    if (!shard) {
+        return FALSE;
+    }
+    pthread_rwlock_wrlock(&shard->lock);
+    result = add_to_trie_len(key, size_of_key, value, shard->trie);
+    pthread_rwlock_unlock(&shard->lock);
+    if (result) {
+        __atomic_fetch_add(&shard->stats.num_adds, 1, __ATOMIC_RELAXED);
+    }
+    
+    return result;
+}
+
+/**
+ * @brief Delete the value stored for a key in a sharded trie.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ *
+ * @return Boolean indicating if we deleted the key, value pair or not.
+ */
+boolean delete_from_sharded_trie (sharded_trie_t *strie, const char *key, size_t size_of_key)
+{
+    shard_t *shard;
+    boolean result;
+    
+    shard = key_shard(strie, key, size_of_key);
+    if (!shard) {
+        return FALSE;
+    }
+    pthread_rwlock_wrlock(&shard->lock);
+    result = delete_from_trie_len(shard->trie, key, size_of_key);
+    pthread_rwlock_unlock(&shard->lock);
+    if (result) {
+        __atomic_fetch_add(&shard->stats.num_deletes, 1, __ATOMIC_RELAXED);
+    }
+    
+    return result;
+}
+
+/**
+ * @brief Lookup a key in a sharded trie.
+ *
+ * @details
+ * Lookups only share the lock of the shard, so they run in parallel with each
+ * other, and with changes to other shards.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value The value found.
+ *
+ * @return Boolean indicating whether a value was found.
+ */
+boolean lookup_in_sharded_trie (sharded_trie_t *strie, const char *key, size_t size_of_key,
+                                int *value)
+{
+    shard_t *shard;
+    boolean result;
+    
+    shard = key_shard(strie, key, size_of_key);
+    if (!shard) {
+        return FALSE;
+    }
+    pthread_rwlock_rdlock(&shard->lock);
+    result = lookup_in_trie_len(shard->trie, key, size_of_key, value);
+    pthread_rwlock_unlock(&shard->lock);
+    __atomic_fetch_add(&shard->stats.num_lookups, 1, __ATOMIC_RELAXED);
+    if (result) {
+        __atomic_fetch_add(&shard->stats.num_hits, 1, __ATOMIC_RELAXED);
+    }
+    
+    return result;
+}
+
+/**
+ * @brief Add many keys to a sharded trie, working on different shards in parallel.
+ *
+ * @details
+ * The keys are sorted by shard and the shards are spread over the worker
+ * threads. The keys of a shard are added in the order they come in, so the
+ * last value given for a key is the one that stays. If memory for sorting the
+ * batch can't be allocated the keys are added one at a time by the caller.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] keys The keys, they need not be NUL terminated.
+ * @param[in] sizes Number of characters in each key.
+ * @param[in] values Value corresponding to each key.
+ * @param[in] num_keys Number of keys.
+ *
+ * @return Boolean indicating if all the keys were added or not.
+ */
+boolean add_batch_to_sharded_trie (sharded_trie_t *strie, const char **keys,
+                                   const size_t *sizes, const int *values, size_t num_keys)
+{
+    shard_job_t job;
+    size_t *order;
+    boolean result;
+    size_t i;
+    
+    if (!sort_batch(strie, &job, keys, sizes, values, num_keys, &order)) {
+        result = TRUE;
+        for (i = 0; i < num_keys; i++) {
+            if (!add_to_sharded_trie(strie, keys[i], sizes[i], values[i])) {
+                result = FALSE;
+            }
+        }
+        
+        return result;
+    }
+    job.type = SHARD_JOB_ADD;
+    dispatch_job(strie, &job);
+    
+    /*
+     * Keys starting with a character that isn't permitted are sorted after
+     * all the shards.
+     */
+    result = !job.failed && (job.start[strie->num_shards] == num_keys);
+    free_batch(&job, order);
+    
+    return result;
+}
+
+/**
+ * @brief Lookup many keys in a sharded trie, working on different shards in parallel.
+ *
+ * @details
+ * The keys are sorted by shard and the shards are spread over the worker
+ * threads, each of which looks up the keys of a shard with lookup_batch_in_trie.
+ * If memory for sorting the batch can't be allocated the keys are looked up one
+ * at a time by the caller.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] keys The keys, they need not be NUL terminated.
+ * @param[in] sizes Number of characters in each key.
+ * @param[in] num_keys Number of keys.
+ * @param[out] values Value found for each key. Left untouched for keys not found.
+ * @param[out] found Whether a value was found for each key.
+ */
+void lookup_batch_in_sharded_trie (sharded_trie_t *strie, const char **keys,
+                                   const size_t *sizes, size_t num_keys, int *values,
+                                   boolean *found)
+{
+    shard_job_t job;
+    size_t *order;
+    size_t i;
+    
+    if (!sort_batch(strie, &job, keys, sizes, NULL, num_keys, &order)) {
+        for (i = 0; i < num_keys; i++) {
+            found[i] = lookup_in_sharded_trie(strie, keys[i], sizes[i], &values[i]);
+        }
+        return;
+    }
+    job.type = SHARD_JOB_LOOKUP;
+    dispatch_job(strie, &job);
+    for (i = 0; i < num_keys; i++) {
+        found[order[i]] = (i < job.start[strie->num_shards]) && job.found[i];
+        if (found[order[i]]) {
+            values[order[i]] = job.values[i];
+        }
+    }
+    free_batch(&job, order);
+}
+
+/**
+ * @brief Get the number of shards of a sharded trie.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ *
+ * @return Number of shards.
+ */
+size_t sharded_trie_num_shards (sharded_trie_t *strie)
+{
+    return strie->num_shards;
+}
+
+/**
+ * @brief Get the counters of a shard.
+ *
+ * @details
+ * Shard i holds the keys starting with the i-th character of the alphabet,
+ * as well as the empty key for shard 0.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] shard Index of the shard, below sharded_trie_num_shards().
+ * @param[out] stats The counters of the shard.
+ */
+void sharded_trie_stats (sharded_trie_t *strie, size_t shard, sharded_trie_stats_t *stats)
+{
+    sharded_trie_stats_t *shard_stats;
+    
+    shard_stats = &strie->shards[shard].stats;
+    stats->num_adds = __atomic_load_n(&shard_stats->num_adds, __ATOMIC_RELAXED);
+    stats->num_deletes = __atomic_load_n(&shard_stats->num_deletes, __ATOMIC_RELAXED);
+    stats->num_lookups = __atomic_load_n(&shard_stats->num_lookups, __ATOMIC_RELAXED);
+    stats->num_hits = __atomic_load_n(&shard_stats->num_hits, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Find the shard of a key.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] key The key.
+ * @param[in] size_of_key Number of characters in the key.
+ *
+ * @return Pointer to the shard or NULL if the key starts with a character that
+ * isn't permitted.
+ */
+static shard_t *key_shard (sharded_trie_t *strie, const char *key, size_t size_of_key)
+{
+    unsigned short shard;
+    
+    if (!size_of_key) {
+        return &strie->shards[0];
+    }
+    shard = strie->char_to_shard[(unsigned char)key[0]];
+    if (shard == INVALID_SHARD) {
+        return NULL;
+    }
+    
+    return &strie->shards[shard];
+}
+
+/**
+ * @brief Sort the keys of a batch by shard.
+ *
+ * @details
+ * A counting sort, which keeps the keys of each shard in the order they came in.
+ * Keys starting with a character that isn't permitted are put after those of
+ * the last shard.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[out] job The batch, with its sorted keys, sizes and values.
+ * @param[in] keys The keys of the batch.
+ * @param[in] sizes Number of characters in each key.
+ * @param[in] values Value corresponding to each key or NULL for a lookup.
+ * @param[in] num_keys Number of keys.
+ * @param[out] order Index in keys of each of the sorted keys, to be freed
+ *             with free_batch().
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean sort_batch (sharded_trie_t *strie, shard_job_t *job, const char **keys,
+                           const size_t *sizes, const int *values, size_t num_keys,
+                           size_t **order)
+{
+    unsigned short shard;
+    size_t i, j;
+    
+    memset(job, 0, sizeof(shard_job_t));
+    *order = (size_t *) malloc (sizeof(size_t) * (num_keys + 1));
+    job->start = (size_t *) calloc (strie->num_shards + 3, sizeof(size_t));
+    job->keys = (const char **) malloc (sizeof(char *) * (num_keys + 1));
+    job->sizes = (size_t *) malloc (sizeof(size_t) * (num_keys + 1));
+    job->values = (int *) malloc (sizeof(int) * (num_keys + 1));
+    job->found = (boolean *) malloc (sizeof(boolean) * (num_keys + 1));
+    if (!*order || !job->start || !job->keys || !job->sizes || !job->values || !job->found) {
+        goto error_handling;
+    }
+    
+    /*
+     * Count the keys of shard i in start[i + 2], so that after summing up
+     * start[i + 1] is where they go. Moving that along while placing the keys
+     * leaves it where the keys of the next shard start.
+     */
+    for (i = 0; i < num_keys; i++) {
+        shard = sizes[i] ? strie->char_to_shard[(unsigned char)keys[i][0]] : 0;
+        if (shard == INVALID_SHARD) {
+            shard = strie->num_shards;
+        }
+        job->start[shard + 2]++;
+    }
+    for (i = 2; i < strie->num_shards + 3; i++) {
+        job->start[i] += job->start[i - 1];
+    }
+    for (i = 0; i < num_keys; i++) {
+        shard = sizes[i] ? strie->char_to_shard[(unsigned char)keys[i][0]] : 0;
+        if (shard == INVALID_SHARD) {
+            shard = strie->num_shards;
+        }
+        j = job->start[shard + 1]++;
+        (*order)[j] = i;
+        job->keys[j] = keys[i];
+        job->sizes[j] = sizes[i];
+        job->values[j] = values ? values[i] : 0;
+    }
+    
+    return TRUE;
+    
+error_handling:
+    free_batch(job, *order);
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free the memory of a batch sorted by sort_batch().
+ *
+ * @param[in] job The batch.
+ * @param[in] order Index in the keys of the batch of each of the sorted keys.
+ */
+static void free_batch (shard_job_t *job, size_t *order)
+{
+    free(order);
+    free(job->start);
+    free(job->keys);
+    free(job->sizes);
+    free(job->values);
+    free(job->found);
+}
+
+/**
+ * @brief Work on the shards of a batch until they have all been taken.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] job The batch.
+ */
+static void run_job (sharded_trie_t *strie, shard_job_t *job)
+{
+    shard_t *shard;
+    size_t i, j, begin, end;
+    unsigned long num_done;
+    
+    while ((i = __atomic_fetch_add(&job->next_shard, 1, __ATOMIC_RELAXED)) < strie->num_shards) {
+        shard = &strie->shards[i];
+        if (job->type == SHARD_JOB_DESTROY) {
+            destroy_trie(shard->trie);
+            shard->trie = NULL;
+            continue;
+        }
+        begin = job->start[i];
+        end = job->start[i + 1];
+        if (begin == end) {
+            continue;
+        }
+        
+        num_done = 0;
+        if (job->type == SHARD_JOB_ADD) {
+            pthread_rwlock_wrlock(&shard->lock);
+            for (j = begin; j < end; j++) {
+                if (add_to_trie_len(job->keys[j], job->sizes[j], job->values[j], shard->trie)) {
+                    num_done++;
+                }
+            }
+            pthread_rwlock_unlock(&shard->lock);
+            if (num_done < end - begin) {
+                __atomic_store_n(&job->failed, TRUE, __ATOMIC_RELAXED);
+            }
+            __atomic_fetch_add(&shard->stats.num_adds, num_done, __ATOMIC_RELAXED);
+        } else {
+            pthread_rwlock_rdlock(&shard->lock);
+            lookup_batch_in_trie(shard->trie, job->keys + begin, job->sizes + begin,
+                                 end - begin, job->values + begin, job->found + begin);
+            pthread_rwlock_unlock(&shard->lock);
+            for (j = begin; j < end; j++) {
+                num_done += job->found[j];
+            }
+            __atomic_fetch_add(&shard->stats.num_lookups, end - begin, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&shard->stats.num_hits, num_done, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Have the worker threads and the caller work on a batch and wait for it
+ * to be done.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ * @param[in] job The batch.
+ */
+static void dispatch_job (sharded_trie_t *strie, shard_job_t *job)
+{
+    pthread_mutex_lock(&strie->dispatch_lock);
+    pthread_mutex_lock(&strie->lock);
+    strie->job = job;
+    strie->num_busy = strie->num_threads;
+    strie->generation++;
+    pthread_cond_broadcast(&strie->work_cond);
+    pthread_mutex_unlock(&strie->lock);
+    
+    run_job(strie, job);
+    
+    pthread_mutex_lock(&strie->lock);
+    while (strie->num_busy) {
+        pthread_cond_wait(&strie->done_cond, &strie->lock);
+    }
+    strie->job = NULL;
+    pthread_mutex_unlock(&strie->lock);
+    pthread_mutex_unlock(&strie->dispatch_lock);
+}
+
+/**
+ * @brief Body of a worker thread of a sharded trie.
+ *
+ * @details
+ * Wait for a batch, work on it along with the other threads and report back
+ * when there are no shards left to take, until the trie is destroyed.
+ *
+ * @param[in] arg Pointer to the sharded trie.
+ *
+ * @return NULL.
+ */
+static void *shard_worker (void *arg)
+{
+    sharded_trie_t *strie;
+    shard_job_t *job;
+    unsigned long generation;
+    
+    strie = (sharded_trie_t *)arg;
+    generation = 0;
+    pthread_mutex_lock(&strie->lock);
+    for (;;) {
+        while (!strie->shutdown && (strie->generation == generation)) {
+            pthread_cond_wait(&strie->work_cond, &strie->lock);
+        }
+        if (strie->shutdown) {
+            break;
+        }
+        generation = strie->generation;
+        job = strie->job;
+        pthread_mutex_unlock(&strie->lock);
+        
+        run_job(strie, job);
+        
+        pthread_mutex_lock(&strie->lock);
+        if (!--strie->num_busy) {
+            pthread_cond_signal(&strie->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&strie->lock);
+    
+    return NULL;
+}
+
+/**
+ * @brief Make the worker threads of a sharded trie exit and wait for them.
+ *
+ * @param[in] strie Pointer to the sharded trie.
+ */
+static void stop_workers (sharded_trie_t *strie)
+{
+    unsigned int i;
+    
+    pthread_mutex_lock(&strie->lock);
+    strie->shutdown = TRUE;
+    pthread_cond_broadcast(&strie->work_cond);
+    pthread_mutex_unlock(&strie->lock);
+    for (i = 0; i < strie->num_threads; i++) {
+        pthread_join(strie->threads[i], NULL);
+    }
+    free(strie->threads);
+    pthread_mutex_destroy(&strie->dispatch_lock);
+    pthread_mutex_destroy(&strie->lock);
+    pthread_cond_destroy(&strie->work_cond);
+    pthread_cond_destroy(&strie->done_cond);
+}
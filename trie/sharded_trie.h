@@ -0,0 +1,42 @@
+/**
+ * Copyright © 2016 Ashutosh Grewal. All rights reserved.
+ *
+ * @file sharded_trie.h
+ * @author Ashutosh Grewal on 12/10/16.
+ *
+ * @brief Header file containing APIs to the sharded trie, a trie split
+ * into independently locked sub-tries by the first character of the key.
+ */
+
+
+#ifndef _SHARDED_TRIE_H_
+#define _SHARDED_TRIE_H_
+
+#include <stddef.h>
+#include "trie.h"
+
+typedef struct sharded_trie_s sharded_trie_t;
+
+/**
+ * @brief Counters of the operations done on one shard.
+ */
+typedef struct sharded_trie_stats_s {
+    unsigned long num_adds;                  /**< Keys added or updated. */
+    unsigned long num_deletes;               /**< Keys deleted. */
+    unsigned long num_lookups;               /**< Keys looked up. */
+    unsigned long num_hits;                  /**< Lookups that found a value. */
+} sharded_trie_stats_t;
+
+sharded_trie_t *create_sharded_trie (const char *, unsigned int);
+void destroy_sharded_trie (sharded_trie_t *);
+boolean add_to_sharded_trie (sharded_trie_t *, const char *, size_t, int);
+boolean delete_from_sharded_trie (sharded_trie_t *, const char *, size_t);
+boolean lookup_in_sharded_trie (sharded_trie_t *, const char *, size_t, int *value);
+boolean add_batch_to_sharded_trie (sharded_trie_t *, const char **, const size_t *,
+                                   const int *values, size_t);
+void lookup_batch_in_sharded_trie (sharded_trie_t *, const char **, const size_t *, size_t,
+                                   int *values, boolean *found);
+size_t sharded_trie_num_shards (sharded_trie_t *);
+void sharded_trie_stats (sharded_trie_t *, size_t, sharded_trie_stats_t *stats);
+
+#endif /* _SHARDED_TRIE_H_ */
@@ -4,14 +4,38 @@
  * @file trie.c
  * @brief This file implements the trie data structure.
  * @details
- * The trie data structure is implemented as a node with 26 (english alphabet size) children.
- * Each child's key is the integer value of 26 letters. The tree starts down from the root.
+ * The trie data structure is implemented as a tree of nodes, one level per character of
+ * the key, where each node can point to a child for every character of the alphabet
+ * of the trie (by default the 26 letters of the english alphabet). Each child's key is
+ * the index of its character in the alphabet. The tree starts down from the root.
  * The first level of the tree contains the first character of each of the keys (if there
  * are multiple keys with the same starting character, they'll share this element), the
  * second level contains the second character of the keys and so forth. While adding the last
  * character of the key, we mark that this element has a value and place the value in the
  * element. Deletion requires that we delete each element that leads us to the element with value.
  *
+ * Most nodes in a trie only have one or two children, so rather than carrying a child
+ * pointer per character in every node we use an adaptive family of node types (as in
+ * the adaptive radix tree):
+ *  - NODE_4 and NODE_16 keep a small sorted array of key indices next to their child
+ *    pointers.
+ *  - NODE_48 keeps a direct index array that maps a key index to one of 48 child slots.
+ *  - NODE_FULL keeps one child pointer per character of the alphabet.
+ * A node grows into the next bigger type when it runs out of slots while adding a child
+ * and shrinks back into a smaller type when enough children are removed. Types whose
+ * capacity is not smaller than the alphabet are skipped, so with 26 characters a NODE_16
+ * grows straight into a NODE_FULL. The depth of the tree and hence the number of nodes
+ * visited during a lookup is the same as with fixed size nodes.
+ *
+ * Chains of nodes that have a single child and no value are collapsed into one node
+ * (path compression, as in a radix/Patricia tree). Such a node carries the characters
+ * it stands for as a prefix, stored right after the type specific part of the node.
+ * A node for a key is thus reached after matching the prefix of every node on the way
+ * plus one character per edge. Adding a key that diverges within a prefix splits the
+ * node at that point and deleting a key merges a node that is left with one child and
+ * no value back into that child. Prefixes are never changed in place, a node with a
+ * different prefix is always a new copy.
+ *
  * @author Ashutosh Grewal on 12/10/16.
  *
  * @bug No bugs are know at this point.
@@ -20,366 +44,7690 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "trie.h"
 
-#define NUM_CHILD 26
+#define MAX_NUM_CHILD 256             /**< Biggest possible alphabet, all the bytes. */
+#define INVALID_INDEX MAX_NUM_CHILD   /**< Index of characters not permitted in a key. */
+
+#define NODE4_MAX_CHILD  4            /**< Capacity of a NODE_4. */
+#define NODE16_MAX_CHILD 16           /**< Capacity of a NODE_16. */
+#define NODE48_MAX_CHILD 48           /**< Capacity of a NODE_48. */
+
+#define NODE16_MIN_CHILD 3            /**< Shrink a NODE_16 into a NODE_4 at this count. */
+#define NODE48_MIN_CHILD 12           /**< Shrink a NODE_48 into a NODE_16 at this count. */
+#define NODE_FULL_MIN_CHILD(trie)                                               \
+    (((trie)->alphabet_size > NODE48_MAX_CHILD) ? 37 : NODE48_MIN_CHILD)
+                                      /**< Shrink a NODE_FULL at this count. The slack
+                                           between the grow and shrink thresholds keeps
+                                           a node from flapping between two types. */
+
+#define FREE_STACK_SIZE 64            /**< Nodes that fit on the stack of free_children
+                                           before it has to go to the heap. */
+
+#define ARENA_DEFAULT_SLAB_SIZE (64 * 1024)
+                                      /**< Slab size used if the caller doesn't care. */
+#define ARENA_GRANULE 16              /**< Arena blocks are multiples of this size. */
+#define ARENA_MAX_BLOCK 4096          /**< Bigger blocks don't come out of slabs. A
+                                           NODE_FULL over all 256 bytes still does. */
+#define ARENA_NUM_CLASSES (ARENA_MAX_BLOCK / ARENA_GRANULE + 1)
+
+#define ITER_STACK_SIZE 16            /**< Initial depth of the stack of an iterator. */
+#define ITER_KEY_SIZE 64              /**< Initial size of the key of an iterator. */
+
+#define TOP_K_HEAP_SIZE 64            /**< Initial number of entries of the heap of a
+                                           top K search. */
+
+#define VERSION_OBSOLETE 1            /**< Version bit of a node that has been replaced. */
+#define VERSION_LOCKED 2              /**< Version bit of a node being changed. */
+#define SEALED_CHILD ((node_t *)1)    /**< Fills a free slot of a full node of a concurrent
+                                           trie that no child may be added to. */
+
+#define EPOCH_SLOTS 64                /**< Counters of threads in a critical section of a
+                                           concurrent trie, threads are spread over them. */
+#define RECLAIM_THRESHOLD 64          /**< Retired nodes that make a writer try to free
+                                           some. */
+
+#define POINTER_ALIGN(size)                                                     \
+    (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define RELEASE_STACK_SIZE 64         /**< Nodes of a persistent trie whose children are
+                                           released without recursing. */
+
+#define MAPPED_MAGIC "TRIEMAP"         /**< First bytes of a file written by save_trie(). */
+#define MAPPED_VERSION 1              /**< Version of the layout of such a file. */
+#define MAPPED_BYTE_ORDER 0x01020304  /**< Reads differently on a machine with another
+                                           byte order. */
+#define MAPPED_ALIGN 8                /**< Nodes of such a file start at multiples of
+                                           this. */
+
+#define ORDER_SIZE 1024               /**< Initial number of nodes of the breadth first
+                                           order of a trie. */
+#define FROZEN_WORD_BITS 64           /**< Bits in a word of a bitmap of a frozen node. */
+
+#define RANK_BLOCK_BITS 512           /**< Bits of a bitvector per count of the bits
+                                           set before them. */
+#define SELECT_SAMPLE 512             /**< Zeros of a bitvector per position of a zero
+                                           kept to find zeros by number. */
+
+#define DOUBLE_ARRAY_SIZE 1024        /**< Initial number of cells of a double-array
+                                           trie being built. */
+#define DOUBLE_ARRAY_FREE (-1)        /**< Check of a free cell of a double-array trie. */
+#define DOUBLE_ARRAY_ROOT (-2)        /**< Check of the root of a double-array trie. */
+#define DOUBLE_ARRAY_UNLISTED (-2)    /**< Previous free cell of a cell that isn't on
+                                           the list of free cells. */
+#define DOUBLE_ARRAY_MAX_FAILURES 16  /**< Times the children of a state may fail to
+                                           fit at a free cell before it isn't tried
+                                           any more. */
+
+#define PATTERN_MASK_WORDS (MAX_NUM_CHILD / 64) /**< Words in a bitmap of key indices. */
+
+#define BATCH_GROUP_SIZE 16           /**< Lookups of a batch that are in flight at once. */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Hint that a node is about to be looked at, so that the cache misses of many
+ * lookups can overlap.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH_NODE(node)                                                     \
+    do {                                                                        \
+        __builtin_prefetch((node), 0, 3);                                       \
+        __builtin_prefetch((char *)(node) + CACHE_LINE_SIZE, 0, 3);             \
+    } while (0)
+#else
+#define PREFETCH_NODE(node)
+#endif
+
+/**
+ * @brief Outcome of looking at one node during a lookup.
+ */
+typedef enum lookup_step_e {
+    LOOKUP_NEXT,                      /**< Go on to the next node. */
+    LOOKUP_DONE,                      /**< The node is the one for the whole key. */
+    LOOKUP_END,                       /**< The node matches the key so far, but has
+                                           no child for the rest of the key. */
+    LOOKUP_MISS                       /**< The key isn't in the trie. */
+} lookup_step_t;
+
+/**
+ * @brief Type of a node.
+ */
+typedef enum node_type_e {
+    NODE_4,                           /**< Up to 4 children in a sorted array. */
+    NODE_16,                          /**< Up to 16 children in a sorted array. */
+    NODE_48,                          /**< Up to 48 children addressed via an index. */
+    NODE_FULL                         /**< One child per character of the alphabet. */
+} node_type_t;
+
+/**
+ * @brief An individual element of the trie.
+ *
+ * @details
+ * A node with in each level of the trie that points to the next level of the trie.
+ * If the element contains a value, it is so marked and the value stored. This is the
+ * header common to all node types, the pointers to the next level follow it and are
+ * laid out according to the type of the node.
+ */
+typedef struct node_s {
+    unsigned char type;               /**< One of node_type_t. */
+    unsigned short num_children;      /**< Number of children in use. */
+    boolean has_value;                /**< Boolean indicating if a value is stored or
+                                           this node has no value and is just part of
+                                           the chain to reach the next level. */
+    int value;                        /**< Value stored for a particular key. */
+    int max_value;                    /**< Largest value stored in the node or below
+                                           it, INT_MIN if there is none. */
+    unsigned int prefix_len;          /**< Number of key indices in the prefix. */
+    unsigned int version;             /**< Version of the node in a concurrent trie,
+                                           see read_lock(), or number of references
+                                           to it in a persistent trie, see
+                                           release_node(). */
+} node_t;
+
+/**
+ * @brief Node with up to 4 children.
+ */
+typedef struct node4_s {
+    node_t node;                             /**< Common header. */
+    unsigned char key[NODE4_MAX_CHILD];      /**< Sorted key indices of the children. */
+    node_t *child[NODE4_MAX_CHILD];          /**< child[i] is the child for key[i]. */
+} node4_t;
+
+/**
+ * @brief Node with up to 16 children.
+ */
+typedef struct node16_s {
+    node_t node;                             /**< Common header. */
+    unsigned char key[NODE16_MAX_CHILD];     /**< Sorted key indices of the children. */
+    node_t *child[NODE16_MAX_CHILD];         /**< child[i] is the child for key[i]. */
+} node16_t;
+
+/**
+ * @brief Node with up to 48 children.
+ */
+typedef struct node48_s {
+    node_t node;                             /**< Common header. */
+    unsigned char child_index[MAX_NUM_CHILD];
+                                             /**< 1 + slot in child for a key index or
+                                                  0 if there is no such child. */
+    node_t *child[NODE48_MAX_CHILD];         /**< Unordered child slots. */
+} node48_t;
+
+/**
+ * @brief Node with a child pointer for every character of the alphabet.
+ *
+ * @details
+ * The number of child pointers is the size of the alphabet of the trie.
+ */
+typedef struct node_full_s {
+    node_t node;                             /**< Common header. */
+    node_t *child[];                         /**< Pointers to the next level of trie. */
+} node_full_t;
+
+/**
+ * @brief A lookup of a batch that is in flight.
+ */
+typedef struct batch_lookup_s {
+    node_t *node;                     /**< Node to be looked at next. */
+    size_t key;                       /**< Index of the key in the batch. */
+    size_t matched;                   /**< Characters of the key matched so far. */
+} batch_lookup_t;
+
+/**
+ * @brief A node on the way from the start of an iteration to the current node.
+ */
+typedef struct iter_frame_s {
+    node_t *node;                     /**< The node. */
+    int next;                         /**< Key index to look for the next child from, or
+                                           -1 if the value of the node is yet to be
+                                           visited. */
+    size_t key_len;                   /**< Length of the key of the node. */
+} iter_frame_t;
+
+/**
+ * @brief Cursor going through the keys of a trie in order.
+ *
+ * @details
+ * The cursor does a depth first walk with an explicit stack of nodes and
+ * builds up the key of the current node in a buffer of its own, which is
+ * only reallocated when a key longer than any seen before comes up.
+ */
+struct trie_iter_s {
+    trie_t *trie;                     /**< The trie being walked. */
+    iter_frame_t *stack;              /**< Nodes on the way to the current node. */
+    int depth;                        /**< Number of frames in use. */
+    int stack_size;                   /**< Number of frames allocated. */
+    char *key;                        /**< Key of the current node. */
+    size_t key_size;                  /**< Bytes allocated for key. */
+};
+
+/**
+ * @brief A node or value waiting to be looked at by a top K search.
+ */
+typedef struct top_k_entry_s {
+    int score;                        /**< The value, or the largest value below the
+                                           node. */
+    boolean is_value;                 /**< Boolean indicating if this is the value of
+                                           a node that has been expanded already. */
+    node_t *node;                     /**< The node, unused for a value. */
+    size_t visit;                     /**< For a node the visit of its parent, for a
+                                           value the visit of the node holding it. */
+    unsigned char index;              /**< Key index on the edge to the node. */
+} top_k_entry_t;
+
+/**
+ * @brief A node expanded by a top K search.
+ */
+typedef struct top_k_visit_s {
+    node_t *node;                     /**< The node. */
+    size_t parent;                    /**< Visit of the parent of the node. */
+    unsigned char index;              /**< Key index on the edge to the node. */
+} top_k_visit_t;
+
+/**
+ * @brief Counters of the threads that are using a concurrent trie.
+ *
+ * @details
+ * Each counter is on a cache line of its own, so threads using different
+ * counters don't get in each other's way.
+ */
+typedef union epoch_slot_u {
+    unsigned long active[2];                 /**< Threads in a critical section, by
+                                                  the parity of their epoch. */
+    char padding[CACHE_LINE_SIZE];           /**< Alignment of the next counter. */
+} epoch_slot_t;
+
+/**
+ * @brief A version of a persistent trie that stays as it is.
+ */
+struct trie_snapshot_s {
+    trie_t *trie;                            /**< The trie. */
+    node_t *root;                            /**< Root of the version, referenced by
+                                                  the snapshot. */
+};
+
+/**
+ * @brief Header at the start of a file written by save_trie().
+ *
+ * @details
+ * Everything in the file is in the byte order of the machine that wrote it and
+ * nodes refer to each other by their offset from the start of the file, so the
+ * file can be looked up in as it is, wherever it is mapped.
+ */
+typedef struct mapped_header_s {
+    char magic[8];                           /**< MAPPED_MAGIC. */
+    uint32_t version;                        /**< MAPPED_VERSION. */
+    uint32_t byte_order;                     /**< MAPPED_BYTE_ORDER. */
+    uint64_t size;                           /**< Size of the file. */
+    uint64_t root;                           /**< Offset of the root node. */
+    uint16_t char_to_index[MAX_NUM_CHILD];   /**< As in the trie. */
+} mapped_header_t;
+
+/**
+ * @brief A node in a file written by save_trie().
+ *
+ * @details
+ * The header is followed by the offsets of the children, their key indices
+ * in increasing order and the key indices of the prefix of the node, padded
+ * to a multiple of MAPPED_ALIGN. A node comes after all of its children.
+ */
+typedef struct mapped_node_s {
+    uint32_t has_value;                      /**< As in node_t. */
+    int32_t value;                           /**< As in node_t. */
+    uint32_t prefix_len;                     /**< As in node_t. */
+    uint32_t num_children;                   /**< As in node_t. */
+} mapped_node_t;
+
+/**
+ * @brief A node being saved, waiting for its children to be written.
+ */
+typedef struct save_frame_s {
+    node_t *node;                            /**< The node. */
+    int next;                                /**< Key index to look for the next
+                                                  child from. */
+    unsigned int num_children;               /**< Children written so far. */
+    uint64_t child[MAX_NUM_CHILD];           /**< Offsets of the children written. */
+    unsigned char key[MAX_NUM_CHILD];        /**< Key indices of those children. */
+} save_frame_t;
+
+/**
+ * @brief A file written by save_trie() mapped into memory.
+ */
+struct mapped_trie_s {
+    const unsigned char *base;               /**< Start of the mapping. */
+    size_t size;                             /**< Size of the mapping. */
+    const mapped_node_t *root;               /**< The root node. */
+    const uint16_t *char_to_index;           /**< Index of each character. */
+};
+
+/**
+ * @brief A node of a frozen trie.
+ *
+ * @details
+ * The children of a node are next to each other in the order of their key
+ * indices. Which key indices they are is kept in a bitmap, so the child for a
+ * key index is found by counting the bits set before it.
+ */
+typedef struct frozen_node_s {
+    uint32_t first_child;                    /**< Index of the first child. */
+    uint32_t bitmap;                         /**< Index of the first word of the
+                                                  bitmap of the children, 0 for no
+                                                  children. */
+    uint32_t prefix;                         /**< Index of the prefix of the node. */
+    uint32_t prefix_len : 31;                /**< As in node_t. */
+    uint32_t has_value : 1;                  /**< As in node_t. */
+    int32_t value;                           /**< As in node_t. */
+} frozen_node_t;
+
+/**
+ * @brief Read only copy of a trie laid out for lookups.
+ *
+ * @details
+ * Nodes are in breadth first order in one array, the bitmaps and prefixes of
+ * all the nodes in two more, and nodes refer to each other by 32 bit indices.
+ */
+struct frozen_trie_s {
+    frozen_node_t *nodes;                    /**< Nodes, the root first. */
+    uint64_t *bitmaps;                       /**< Bitmaps of the nodes, the first one
+                                                  is empty and shared by all the nodes
+                                                  without children. */
+    unsigned char *prefixes;                 /**< Prefixes of the nodes. */
+    unsigned int bitmap_words;               /**< Words in a bitmap. */
+    unsigned short char_to_index[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+    unsigned char index_to_char[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+};
+
+/**
+ * @brief A node of a frozen trie on the way from the start of an iteration
+ * to the current node.
+ */
+typedef struct frozen_frame_s {
+    uint32_t node;                           /**< Index of the node. */
+    int next;                                /**< As in iter_frame_t. */
+    uint32_t child;                          /**< Index of the next child. */
+    size_t key_len;                          /**< Length of the key of the node. */
+} frozen_frame_t;
+
+/**
+ * @brief Cursor going through the keys of a frozen trie in order.
+ */
+struct frozen_iter_s {
+    frozen_trie_t *frozen;                   /**< The frozen trie being walked. */
+    frozen_frame_t *stack;                   /**< Nodes on the way to the current node. */
+    int depth;                               /**< Number of frames in use. */
+    int stack_size;                          /**< Number of frames allocated. */
+    char *key;                               /**< Key of the current node. */
+    size_t key_size;                         /**< Bytes allocated for key. */
+};
+
+/**
+ * @brief Bits with a directory to count and find bits without going through
+ * all of them.
+ */
+typedef struct bitvector_s {
+    uint64_t *words;                         /**< The bits, the first one in the
+                                                  lowest bit of the first word. */
+    size_t num_bits;                         /**< Number of bits. */
+    uint32_t *ranks;                         /**< Bits set before each block of
+                                                  RANK_BLOCK_BITS bits and before the
+                                                  end. */
+    uint32_t *zeros;                         /**< Positions of every SELECT_SAMPLE-th
+                                                  zero, or NULL if zeros aren't looked
+                                                  for by number. */
+} bitvector_t;
+
+/**
+ * @brief Read only copy of a trie in a succinct representation.
+ *
+ * @details
+ * The shape of the trie is kept in level order unary degree sequence (LOUDS):
+ * after a 1 and a 0 for a super root, every node in breadth first order is
+ * written as a 1 for each of its children followed by a 0. The i-th 1 stands
+ * for the i-th node, whose children start after the (i + 1)-th 0. The rest of
+ * what there is to a node is in arrays indexed by its number or by the number
+ * of nodes before it that have a value or a prefix.
+ */
+struct louds_trie_s {
+    bitvector_t louds;                       /**< Shape of the trie. */
+    bitvector_t has_value;                   /**< Nodes with a value. */
+    bitvector_t has_prefix;                  /**< Nodes with a prefix. */
+    unsigned char *labels;                   /**< Key index on the edge to each node. */
+    int *values;                             /**< Values of the nodes with a value. */
+    uint32_t *prefix_starts;                 /**< Start of the prefix of each node with
+                                                  a prefix and the end of the last. */
+    unsigned char *prefixes;                 /**< Prefixes of the nodes. */
+    unsigned short char_to_index[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+    unsigned char index_to_char[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+};
+
+/**
+ * @brief A node of a LOUDS trie on the way from the start of an iteration to
+ * the current node.
+ */
+typedef struct louds_frame_s {
+    uint32_t node;                           /**< Number of the node. */
+    boolean visited;                         /**< Boolean indicating if the value of
+                                                  the node has been visited. */
+    size_t next;                             /**< Position of the next child. */
+    size_t end;                              /**< Position after the last child. */
+    size_t key_len;                          /**< Length of the key of the node. */
+} louds_frame_t;
+
+/**
+ * @brief Cursor going through the keys of a LOUDS trie in order.
+ */
+struct louds_iter_s {
+    louds_trie_t *louds;                     /**< The LOUDS trie being walked. */
+    louds_frame_t *stack;                    /**< Nodes on the way to the current node. */
+    int depth;                               /**< Number of frames in use. */
+    int stack_size;                          /**< Number of frames allocated. */
+    char *key;                               /**< Key of the current node. */
+    size_t key_size;                         /**< Bytes allocated for key. */
+};
+
+/**
+ * @brief Read only copy of a trie as a double array.
+ *
+ * @details
+ * Every state, one per character of a key as in a trie without path
+ * compression, is a cell of two arrays. The child of a state for a key index
+ * is at the base of the state plus the key index plus 1, and is only a child
+ * if its check is the state. The value of a state is kept in the base of its
+ * child for code 0, which has no children of its own.
+ */
+struct double_array_trie_s {
+    int32_t *base;                           /**< Offset of the children of each
+                                                  state, or the value. */
+    int32_t *check;                          /**< Parent of each state,
+                                                  DOUBLE_ARRAY_FREE or
+                                                  DOUBLE_ARRAY_ROOT. */
+    size_t size;                             /**< Number of cells. */
+    unsigned short char_to_index[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+};
+
+/**
+ * @brief State of a double-array trie being built.
+ */
+typedef struct double_array_builder_s {
+    double_array_trie_t *da;                 /**< The double-array trie. */
+    int32_t *next_free;                      /**< Next free cell on the list, or -1. */
+    int32_t *prev_free;                      /**< Previous free cell on the list, -1 or
+                                                  DOUBLE_ARRAY_UNLISTED. */
+    unsigned char *failures;                 /**< Times the children of a state didn't
+                                                  fit at each free cell. */
+    int32_t free_head;                       /**< First free cell on the list, or -1. */
+    int32_t free_tail;                       /**< Last free cell on the list, or -1. */
+    int32_t max_base;                        /**< Biggest base handed out. */
+} double_array_builder_t;
+
+/**
+ * @brief A state of a double-array trie being built, waiting for its children
+ * to be placed.
+ */
+typedef struct double_array_item_s {
+    node_t *node;                            /**< Node the state is part of. */
+    unsigned int offset;                     /**< Characters of the prefix of the
+                                                  node before the state. */
+    int32_t state;                           /**< The state. */
+} double_array_item_t;
+
+/**
+ * @brief A node of a load that keys may still go below.
+ */
+typedef struct load_frame_s {
+    size_t depth;                            /**< Length of the key of the node. */
+    unsigned char index;                     /**< Key index on the edge to the node. */
+    boolean has_value;                       /**< As in node_t. */
+    int value;                               /**< As in node_t. */
+    unsigned int num_children;               /**< Children made so far. */
+    unsigned char key[MAX_NUM_CHILD];        /**< Key indices of the children, in
+                                                  increasing order. */
+    node_t *child[MAX_NUM_CHILD];            /**< The children. */
+} load_frame_t;
+
+/**
+ * @brief State of keys being loaded into a trie in order.
+ */
+struct trie_loader_s {
+    trie_t *trie;                            /**< The trie. */
+    load_frame_t *stack;                     /**< Open nodes on the way to the last
+                                                  key, the root first. */
+    int depth;                               /**< Number of frames in use. */
+    int stack_size;                          /**< Number of frames allocated. */
+    char *key;                               /**< Key indices of the last key. */
+    size_t key_len;                          /**< Length of the last key. */
+    size_t key_size;                         /**< Bytes allocated for key. */
+    char *next_key;                          /**< Key indices of the key being added. */
+    size_t next_key_size;                    /**< Bytes allocated for next_key. */
+    boolean failed;                          /**< Boolean indicating if memory
+                                                  allocation failed. */
+};
+
+/**
+ * @brief Keys of a parallel build that go into a trie of their own.
+ */
+typedef struct trie_part_s {
+    trie_t *trie;                            /**< Trie the keys are added to. */
+    const char **keys;                       /**< All the keys of the build. */
+    const size_t *sizes;                     /**< Number of characters in each key. */
+    const int *values;                       /**< Value of each key. */
+    const size_t *order;                     /**< Positions of the keys, by their first
+                                                  character. */
+    size_t start;                            /**< First position in order of the part. */
+    size_t end;                              /**< Position in order after the part. */
+    pthread_t thread;                        /**< Thread the part is built by. */
+    boolean started;                         /**< Boolean indicating if the thread was
+                                                  started. */
+    boolean result;                          /**< Boolean indicating if the part was
+                                                  built. */
+} trie_part_t;
+
+/**
+ * @brief A state of an Aho-Corasick automaton, one per character of the keys
+ * of the trie it is made from.
+ */
+typedef struct ac_state_s {
+    uint32_t first_child;                    /**< Index of the first child. */
+    uint32_t fail;                           /**< Index of the state of the longest
+                                                  proper suffix of the key of the state
+                                                  that is also in the automaton. */
+    uint32_t output;                         /**< Index of the next state with a value
+                                                  down the chain of fail, 0 if there
+                                                  is none. */
+    uint32_t depth;                          /**< Length of the key of the state. */
+    int value;                               /**< As in node_t. */
+    unsigned short num_children;             /**< Number of children. */
+    unsigned char has_value;                 /**< As in node_t. */
+} ac_state_t;
+
+/**
+ * @brief Aho-Corasick automaton finding the keys of a trie in a text.
+ *
+ * @details
+ * The states are in breadth first order, so the children of a state are next
+ * to each other in the order of their key indices.
+ */
+struct aho_corasick_s {
+    ac_state_t *states;                      /**< States, the root first. */
+    unsigned char *labels;                   /**< Key index on the edge to each state. */
+    unsigned short char_to_index[MAX_NUM_CHILD];
+                                             /**< As in the trie. */
+};
+
+/**
+ * @brief A scan of a text fed to an Aho-Corasick automaton a chunk at a time.
+ */
+struct aho_corasick_scan_s {
+    aho_corasick_t *ac;                      /**< The automaton. */
+    const char *chunk;                       /**< Chunk being scanned. */
+    size_t chunk_size;                       /**< Number of characters in chunk. */
+    size_t pos;                              /**< Position in chunk of the next character. */
+    size_t offset;                           /**< Position in the text of the chunk. */
+    uint32_t state;                          /**< State after the characters so far. */
+    uint32_t match;                          /**< State of the next key to report, 0 if
+                                                  there is none. */
+};
+
+/**
+ * @brief Cursor going through the keys of a trie close to a query.
+ *
+ * @details
+ * As trie_iter_s, with a row of the edit distances between the query and the
+ * key of the current node for each character of the key.
+ */
+struct trie_fuzzy_s {
+    trie_t *trie;                            /**< The trie being walked. */
+    iter_frame_t *stack;                     /**< Nodes on the way to the current node. */
+    int depth;                               /**< Number of frames in use. */
+    int stack_size;                          /**< Number of frames allocated. */
+    char *key;                               /**< Key of the current node. */
+    size_t key_size;                         /**< Bytes allocated for key. */
+    unsigned short *query;                   /**< Key indices of the query,
+                                                  INVALID_INDEX for characters that
+                                                  aren't permitted in a key. */
+    size_t query_len;                        /**< Length of the query. */
+    unsigned int max_distance;               /**< Largest distance of a key found. */
+    unsigned int *rows;                      /**< rows[i * (query_len + 1) + j] is the
+                                                  distance between the first i
+                                                  characters of key and the first j
+                                                  of the query. */
+    size_t num_rows;                         /**< Rows allocated. */
+};
+
+/**
+ * @brief A position of a pattern, matching one character or any number of
+ * characters.
+ */
+typedef struct pattern_element_s {
+    uint64_t matches[PATTERN_MASK_WORDS];    /**< Bit per key index matched. */
+    boolean any_length;                      /**< Boolean indicating if any number of
+                                                  characters in matches are matched,
+                                                  none included. */
+} pattern_element_t;
+
+/**
+ * @brief A node on the way from the start of a pattern search to the current
+ * node.
+ */
+typedef struct pattern_frame_s {
+    node_t *node;                            /**< The node. */
+    int next;                                /**< As in iter_frame_t. */
+    size_t key_len;                          /**< Length of the key of the node. */
+    uint64_t mask[PATTERN_MASK_WORDS];       /**< Key indices of the children that
+                                                  the pattern may go on with. */
+} pattern_frame_t;
+
+/**
+ * @brief Cursor going through the keys of a trie that match a pattern.
+ *
+ * @details
+ * As trie_iter_s, with the set of positions of the pattern that the key of
+ * the current node can be at for each character of the key.
+ */
+struct trie_pattern_s {
+    trie_t *trie;                            /**< The trie being walked. */
+    pattern_frame_t *stack;                  /**< Nodes on the way to the current node. */
+    int depth;                               /**< Number of frames in use. */
+    int stack_size;                          /**< Number of frames allocated. */
+    char *key;                               /**< Key of the current node. */
+    size_t key_size;                         /**< Bytes allocated for key. */
+    pattern_element_t *elements;             /**< The pattern. */
+    size_t num_elements;                     /**< Number of elements of the pattern. */
+    size_t row_words;                        /**< Words in a row. */
+    uint64_t *rows;                          /**< Row i has a bit for each position of
+                                                  the pattern the first i characters of
+                                                  key can be at, num_elements when all
+                                                  of the pattern is matched. */
+    size_t num_rows;                         /**< Rows allocated. */
+};
+
+/**
+ * @brief A slab of memory nodes are carved out of.
+ *
+ * @details
+ * The header is padded to the granule size so the memory that follows it
+ * is suitably aligned for any node.
+ */
+typedef union slab_u {
+    union slab_u *next;                      /**< Next slab of the arena. */
+    char padding[ARENA_GRANULE];             /**< Alignment of what follows. */
+} slab_t;
+
+/**
+ * @brief Header of a block too big to come out of a slab.
+ */
+typedef union big_block_u {
+    struct {
+        union big_block_u *prev;             /**< Previous big block of the arena. */
+        union big_block_u *next;             /**< Next big block of the arena. */
+    } link;
+    char padding[ARENA_GRANULE];             /**< Alignment of what follows. */
+} big_block_t;
+
+/**
+ * @brief Free block waiting to be reused, linked on the list for its size.
+ */
+typedef struct free_block_s {
+    struct free_block_s *next;               /**< Next free block of the same size. */
+} free_block_t;
+
+/**
+ * @brief Node allocator private to a trie.
+ *
+ * @details
+ * Nodes are carved out of big slabs by bumping a pointer, rounding their size
+ * up to a multiple of the granule. Freed nodes go on a free list per rounded
+ * size and are handed out again before any new memory is carved. Slabs are
+ * only given back to the system when the trie is destroyed, all at once.
+ */
+typedef struct arena_s {
+    slab_t *slabs;                           /**< All slabs, most recent first. */
+    big_block_t *big_blocks;                 /**< Blocks bigger than ARENA_MAX_BLOCK. */
+    char *next;                              /**< Next unused byte of the current slab. */
+    char *end;                               /**< End of the current slab. */
+    size_t slab_size;                        /**< Usable bytes in a slab. */
+    free_block_t *free_list[ARENA_NUM_CLASSES];
+                                             /**< free_list[i] holds free blocks of
+                                                  i granules. */
+} arena_t;
+
+/**
+ * @brief Trie data structure.
+ *
+ * @details
+ * A trie data structure contains multiple levels. The first level contains
+ * elements to accomodate all possible characters of the alphabet of the trie
+ * (by default the 26 english alphabet characters). Each of these characters
+ * can point to elements at the second level to represent all possible second
+ * characters of keys. Characters are mapped to dense indices, so small
+ * alphabets keep NODE_FULL nodes small.
+ */
+struct trie_s {
+    node_t *child;                     /**< Pointer to the node that will point level
+                                        of the trie. */
+    arena_t *arena;                    /**< Allocator for the nodes or NULL if they
+                                        are allocated one by one with malloc. */
+    unsigned short alphabet_size;      /**< Number of characters permitted in keys. */
+    unsigned short char_to_index[MAX_NUM_CHILD];
+                                       /**< Index of each character or INVALID_INDEX
+                                        if it isn't permitted in a key. */
+    unsigned char index_to_char[MAX_NUM_CHILD];
+                                       /**< Character for each index. */
+    boolean concurrent;                /**< Boolean indicating if the trie may be used
+                                        by many threads at once. */
+    node_t *retired;                   /**< Nodes of a concurrent trie that have been
+                                        replaced, waiting to be freed. */
+    unsigned int num_retired;          /**< Nodes retired since the last attempt to
+                                        free some. */
+    boolean reclaiming;                /**< Boolean indicating if a thread is freeing
+                                        retired nodes. */
+    unsigned long epoch;               /**< Current epoch of a concurrent trie. */
+    epoch_slot_t *epoch_slots;         /**< EPOCH_SLOTS counters of the threads in a
+                                        critical section. */
+    boolean persistent;                /**< Boolean indicating if changes make a new
+                                        version of the trie. */
+    node_t *draft;                     /**< Root of the version of a persistent trie
+                                        being made. */
+    node_t **path;                     /**< Nodes on the way to the node of a key, kept
+                                        from one add or delete to the next. */
+    unsigned int path_size;            /**< Number of nodes path has room for. */
+};
+
+/*
+ * Forward declarations.
+ */
+static unsigned short key_to_index (trie_t *trie, char ch);
+static boolean node_has_multiple_children (node_t *);
+static boolean node_has_children (node_t *node);
+static size_t node_size (trie_t *trie, node_type_t type);
+static node_t *alloc_node (trie_t *trie, node_type_t type, unsigned int prefix_len);
+static void free_node (trie_t *trie, node_t *node);
+static unsigned char *node_prefix (trie_t *trie, node_t *node);
+static node_t **find_child (node_t *node, unsigned char index);
+static node_t **first_child (trie_t *trie, node_t *node, unsigned char *index);
+static node_t **next_child (trie_t *trie, node_t *node, int from, unsigned char *index);
+static boolean add_child (trie_t *trie, node_t **node_ref, unsigned char index, node_t *child);
+static void remove_child (trie_t *trie, node_t **node_ref, unsigned char index);
+static node_t *copy_node (trie_t *trie, node_t *node, node_type_t type, unsigned int prefix_len);
+static node_t *resize_node (trie_t *trie, node_t *node, node_type_t type);
+static node_t *new_leaf (trie_t *trie, const char *key, size_t size_of_key, int value);
+static boolean split_node (trie_t *trie, node_t **node_ref, unsigned int matched);
+static lookup_step_t lookup_step (trie_t *trie, node_t **node, const char *key,
+                                  size_t size_of_key, size_t *matched);
+static void merge_with_child (trie_t *trie, node_t **node_ref);
+static boolean node_is_full (node_t *node);
+static boolean read_lock (node_t *node, unsigned int *version);
+static boolean check_version (node_t *node, unsigned int version);
+static boolean upgrade_lock (node_t *node, unsigned int version);
+static void write_unlock (node_t *node);
+static void retire_node (trie_t *trie, node_t *node);
+static void free_retired (trie_t *trie);
+static epoch_slot_t *epoch_enter (trie_t *trie, unsigned long *epoch);
+static void epoch_exit (trie_t *trie, epoch_slot_t *slot, unsigned long epoch);
+static void reclaim_retired (trie_t *trie);
+static void raise_max_value (node_t *node, int value);
+static int seal_node (trie_t *trie, node_t *node);
+static void unseal_node (trie_t *trie, node_t *node);
+static boolean concurrent_lookup (trie_t *trie, const char *key, size_t size_of_key,
+                                  int *value, size_t *match_len);
+static boolean concurrent_add (trie_t *trie, const char *key, size_t size_of_key, int value);
+static boolean concurrent_delete (trie_t *trie, const char *key, size_t size_of_key);
+static void batch_lookup (trie_t *trie, const char **keys, const size_t *sizes,
+                          size_t num_keys, int *values, boolean *found, size_t *match_lens);
+static boolean lookup_from (trie_t *trie, node_t *root, const char *key, size_t size_of_key,
+                            int *value);
+static boolean add_from_root (trie_t *trie, node_t **root_ref, const char *key,
+                              size_t size_of_key, int value);
+static boolean delete_from_root (trie_t *trie, node_t **root_ref, const char *key,
+                                 size_t size_of_key);
+static boolean persistent_write (trie_t *trie, const char *key, size_t size_of_key,
+                                 int value, boolean add);
+static void release_node (trie_t *trie, node_t *node);
+static void free_unreferenced (trie_t *trie, node_t *node);
+static void push_retired (trie_t *trie, node_t *node);
+static node_t **retired_link (trie_t *trie, node_t *node);
+static int *retired_epoch (trie_t *trie, node_t *node);
+static node_t **child_slots (trie_t *trie, node_t *node, int *num_slots);
+static void free_children (trie_t *trie, node_t *node);
+static trie_t *new_trie (const char *alphabet, size_t slab_size);
+static boolean grow_path (trie_t *trie, unsigned int depth);
+static void refresh_max_value (trie_t *trie, node_t *node);
+static void lower_max_values (trie_t *trie, unsigned int depth, int old_value);
+static node_t *find_prefix_node (trie_t *trie, const char *prefix, size_t size_of_prefix,
+                                 size_t *key_len);
+static void copy_prefix_key (trie_t *trie, node_t *node, const char *prefix,
+                             size_t size_of_prefix, size_t key_len, char *key,
+                             size_t key_size);
+static boolean top_k_push (top_k_entry_t **heap, size_t *heap_len, size_t *heap_size,
+                           top_k_entry_t *entry);
+static void top_k_pop (top_k_entry_t *heap, size_t *heap_len, top_k_entry_t *entry);
+static boolean top_k_before (top_k_entry_t *a, top_k_entry_t *b);
+static boolean iter_push (trie_iter_t *iter, node_t *node, size_t key_len);
+static boolean reserve_key (char **key, size_t *key_size, size_t key_len);
+static uint64_t write_mapped_node (trie_t *trie, FILE *file, save_frame_t *frame,
+                                   uint64_t *offset);
+static const mapped_node_t *mapped_node_at (mapped_trie_t *mtrie, uint64_t offset);
+static const mapped_node_t *find_mapped_child (mapped_trie_t *mtrie, const mapped_node_t *node,
+                                               unsigned char index);
+static node_t **breadth_first_order (trie_t *trie, size_t *num_nodes);
+static boolean init_bitvector (bitvector_t *bits, size_t num_bits);
+static boolean index_bitvector (bitvector_t *bits, boolean with_zeros);
+static void free_bitvector (bitvector_t *bits);
+static size_t rank_bitvector (bitvector_t *bits, size_t pos);
+static size_t select_zero (bitvector_t *bits, size_t num);
+static size_t next_zero (bitvector_t *bits, size_t pos);
+static void louds_children (louds_trie_t *louds, uint32_t node, size_t *start, size_t *end);
+static uint32_t louds_prefix (louds_trie_t *louds, uint32_t node, unsigned char **prefix);
+static boolean find_louds_child (louds_trie_t *louds, uint32_t *node, unsigned short index);
+static boolean louds_iter_push (louds_iter_t *iter, uint32_t node, size_t key_len);
+static frozen_node_t *find_frozen_child (frozen_trie_t *frozen, frozen_node_t *node,
+                                         unsigned short index);
+static boolean grow_double_array (double_array_builder_t *builder, size_t size);
+static boolean close_load_frames (trie_loader_t *loader, size_t matched);
+static node_t *finish_load_frame (trie_loader_t *loader, load_frame_t *frame, size_t start);
+static void take_double_array_cell (double_array_builder_t *builder, int32_t cell);
+static boolean find_double_array_base (double_array_builder_t *builder, const int *codes,
+                                       int num_codes, int32_t *base);
+static int next_frozen_index (frozen_trie_t *frozen, frozen_node_t *node, int from);
+static boolean frozen_iter_push (frozen_iter_t *iter, uint32_t node, size_t key_len);
+static void *build_trie_part (void *arg);
+static boolean compile_pattern (trie_t *trie, const char *pattern, size_t size_of_pattern,
+                                pattern_element_t *elements, size_t *num_elements);
+static void close_pattern_row (trie_pattern_t *search, uint64_t *row);
+static boolean reserve_pattern_rows (trie_pattern_t *search, size_t key_len);
+static boolean pattern_rows (trie_pattern_t *search, node_t *node, unsigned char index,
+                             size_t key_len);
+static boolean pattern_push (trie_pattern_t *search, node_t *node, size_t key_len);
+static int next_mask_index (const uint64_t *mask, int from);
+static boolean reserve_fuzzy_rows (trie_fuzzy_t *fuzzy, size_t key_len);
+static boolean fuzzy_rows (trie_fuzzy_t *fuzzy, node_t *node, unsigned char index,
+                           size_t key_len);
+static boolean fuzzy_push (trie_fuzzy_t *fuzzy, node_t *node, size_t key_len);
+static boolean find_ac_child (aho_corasick_t *ac, uint32_t state, unsigned char index,
+                              uint32_t *child);
+static void adopt_trie (trie_t *trie, trie_t *part);
+static arena_t *create_arena (size_t slab_size);
+static void destroy_arena (arena_t *arena);
+static void *arena_alloc (arena_t *arena, size_t size);
+static void arena_free (arena_t *arena, void *block, size_t size);
+static void merge_arena (arena_t *arena, arena_t *other);
+
+/**
+ * @brief Create the trie data structure.
+ *
+ * @details.
+ * Allocate the memory for trie and the child node that 
+ * point to level 1. Keys are made of the 26 lowercase english
+ * alphabet characters.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed.
+ */
+trie_t *create_trie (void)
+{
+    return new_trie(TRIE_ALPHABET_LOWERCASE, 0);
+}
+
+/**
+ * @brief Create the trie data structure with its own node allocator.
+ *
+ * @details
+ * Nodes of this trie are carved out of big slabs of memory instead of being
+ * allocated one at a time. Nodes that get deleted are recycled by the trie
+ * and all the slabs are released at once when the trie is destroyed, keys
+ * still in the trie or not. The allocator is private to the trie, so tries
+ * used by different threads don't contend on it.
+ *
+ * @param[in] slab_size Size in bytes of each slab, 0 to use a default size.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed.
+ */
+trie_t *create_trie_with_arena (unsigned int slab_size)
+{
+    return new_trie(TRIE_ALPHABET_LOWERCASE, slab_size ? slab_size : ARENA_DEFAULT_SLAB_SIZE);
+}
+    
+/**
+ * @brief Create the trie data structure for keys made of a particular alphabet.
+ *
+ * @details
+ * Characters of the alphabet are mapped to dense indices in the order they
+ * appear in, which is also the order keys sort in. A NODE_FULL has a child
+ * pointer per character of the alphabet, so small alphabets (DNA, hex digits)
+ * keep nodes small, while TRIE_ALPHABET_BYTES takes any byte, including the
+ * bytes of UTF-8 encoded text, with 256-way branching.
+ *
+ * @param[in] alphabet The characters permitted in keys with no duplicates, or
+ *            TRIE_ALPHABET_BYTES for all 256 byte values.
+ * @param[in] with_arena Whether the nodes come out of an arena of the trie, as
+ *            with create_trie_with_arena.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed or the alphabet
+ * is not valid.
+ */
+trie_t *create_trie_with_alphabet (const char *alphabet, boolean with_arena)
+{
+    return new_trie(alphabet, with_arena ? ARENA_DEFAULT_SLAB_SIZE : 0);
+}
+
+/**
+ * @brief Create a trie that many threads may use at once.
+ *
+ * @details
+ * Lookups, adds and deletes may be called from any number of threads without
+ * any locking by the caller. Readers go down the trie optimistically, checking
+ * the version of each node they have looked at and starting over if it changed,
+ * so they never write to shared memory. Writers go down the same way and only
+ * lock the nodes they change, as in optimistic lock coupling. Nodes that are
+ * replaced may still be looked at by readers, so they are retired and only
+ * freed once every thread that might have seen them is done, which is tracked
+ * with epochs.
+ * The nodes come from malloc, an arena is not shared between threads. Cursors,
+ * top K searches and clearing the trie must not overlap with writers.
+ *
+ * @param[in] alphabet The characters permitted in keys with no duplicates, or
+ *            TRIE_ALPHABET_BYTES for all 256 byte values.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed or the alphabet
+ * is not valid.
+ */
+trie_t *create_concurrent_trie (const char *alphabet)
+{
+    trie_t *trie;
+    
+    trie = new_trie(alphabet, 0);
+    if (!trie) {
+        return NULL;
+    }
+    trie->epoch_slots = (epoch_slot_t *)calloc(EPOCH_SLOTS, sizeof(epoch_slot_t));
+    if (!trie->epoch_slots) {
+        destroy_trie(trie);
+        
+        return NULL;
+    }
+    trie->concurrent = TRUE;
+    
+    return trie;
+}
+
+/**
+ * @brief Create a trie that keeps old versions around for as long as they are used.
+ *
+ * @details
+ * Adds and deletes never change a node that is in the trie. The nodes on the
+ * way from the root to the key are copied instead (path copying) and the new
+ * root takes the place of the old one in a single step once the change is
+ * complete, so lookups always see a version of the trie as a whole and never
+ * wait for a writer. All the other nodes are shared between versions and are
+ * reference counted. trie_snapshot() takes hold of the current version for as
+ * long as needed. Nodes no version refers to any more are freed once no lookup
+ * can be looking at them, which is tracked with epochs as in a concurrent trie.
+ * Lookups may be called from any number of threads, adds, deletes and clearing
+ * the trie from one thread at a time. Cursors and top K searches must not
+ * overlap with writers.
+ *
+ * @param[in] alphabet The characters permitted in keys with no duplicates, or
+ *            TRIE_ALPHABET_BYTES for all 256 byte values.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed or the alphabet
+ * is not valid.
+ */
+trie_t *create_persistent_trie (const char *alphabet)
+{
+    trie_t *trie;
+    node_t *root;
+    
+    trie = new_trie(alphabet, 0);
+    if (!trie) {
+        return NULL;
+    }
+    trie->epoch_slots = (epoch_slot_t *)calloc(EPOCH_SLOTS, sizeof(epoch_slot_t));
+    if (!trie->epoch_slots) {
+        destroy_trie(trie);
+        
+        return NULL;
+    }
+    
+    /*
+     * Nodes of a persistent trie have room for a link after the prefix, see
+     * retired_link(), so the root is allocated again.
+     */
+    trie->persistent = TRUE;
+    root = alloc_node(trie, NODE_FULL, 0);
+    if (!root) {
+        destroy_trie(trie);
+        
+        return NULL;
+    }
+    free_node(trie, trie->child);
+    trie->child = root;
+    
+    return trie;
+}
+
+/**
+ * @brief Add a value with a particular key.
+ *
+ * @param[in] key The key provided to us.
+ * @param[in] value Value corresponding to the key.
+ * @param[in] trie Pointer to the trie.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+boolean add_to_trie (char *key, int value, trie_t *trie)
+{
+    return add_to_trie_len(key, strlen(key), value, trie);
+}
+
+/**
+ * @brief Add a value with a key of a given length.
+ *
+ * @details
+ * Walk down the existing chain for as long as it matches the key. If the key
+ * runs off the end of the chain, hang a new node carrying the rest of the key
+ * off the last node. If the key diverges within the prefix of a node, split
+ * that node at the point of divergence first.
+ * The characters of the key are checked as they are looked at, the rest of
+ * the key is checked while copying it into the new node before anything in
+ * the trie is changed.
+ *
+ * @param[in] key The key provided to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key.
+ * @param[in] trie Pointer to the trie.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+boolean add_to_trie_len (const char *key, size_t size_of_key, int value, trie_t *trie)
+{
+    if (trie == NULL) {
+        return FALSE;
+    }
+    if (trie->concurrent) {
+        epoch_slot_t *slot;
+        unsigned long epoch;
+        boolean done;
+        
+        slot = epoch_enter(trie, &epoch);
+        done = concurrent_add(trie, key, size_of_key, value);
+        epoch_exit(trie, slot, epoch);
+        
+        return done;
+    }
+    
+    if (trie->persistent) {
+        return persistent_write(trie, key, size_of_key, value, TRUE);
+    }
+    
+    return add_from_root(trie, &trie->child, key, size_of_key, value);
+}
+
+/**
+ * @brief Lookup the value stored for a particular key in the trie.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] key  The key supplied to us.
+ * @param[out] value The value stored in the trie for this key.
+ *
+ * @return Boolean indicating whether the lookup succeded of failed.
+ */
+boolean lookup_in_trie (trie_t *trie, char *key, int *value)
+{
+    return lookup_in_trie_len(trie, key, strlen(key), value);
+}
+    
+/**
+ * @brief Lookup the value stored for a key of a given length in the trie.
+ *
+ * @details
+ * Traverse each level of the trie according to the characters in the
+ * key are return the value stored at the last level. A character that
+ * isn't permitted in a key can't match anything in the trie, so there is
+ * no need to check the key up front.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] key  The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value The value stored in the trie for this key.
+ *
+ * @return Boolean indicating whether the lookup succeded of failed.
+ */
+boolean lookup_in_trie_len (trie_t *trie, const char *key, size_t size_of_key, int *value)
+{
+    epoch_slot_t *slot;
+    unsigned long epoch;
+    boolean found;
+    
+    if (trie->concurrent) {
+        slot = epoch_enter(trie, &epoch);
+        found = concurrent_lookup(trie, key, size_of_key, value, NULL);
+        epoch_exit(trie, slot, epoch);
+        
+        return found;
+    }
+    if (trie->persistent) {
+        slot = epoch_enter(trie, &epoch);
+        found = lookup_from(trie, __atomic_load_n(&trie->child, __ATOMIC_ACQUIRE), key,
+                            size_of_key, value);
+        epoch_exit(trie, slot, epoch);
+        
+        return found;
+    }
+    
+    return lookup_from(trie, trie->child, key, size_of_key, value);
+}
+
+/**
+ * @brief Lookup the values stored for a batch of keys.
+ *
+ * @details
+ * The lookups of the batch overlap their cache misses, see batch_lookup().
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] keys The keys supplied to us, they need not be NUL terminated.
+ * @param[in] sizes sizes[i] is the number of characters in keys[i].
+ * @param[in] num_keys Number of keys in the batch.
+ * @param[out] values values[i] is the value stored for keys[i] if found[i] is
+ *             TRUE, otherwise it is left untouched.
+ * @param[out] found found[i] tells whether keys[i] is in the trie.
+ */
+void lookup_batch_in_trie (trie_t *trie, const char **keys, const size_t *sizes,
+                           size_t num_keys, int *values, boolean *found)
+{
+    batch_lookup(trie, keys, sizes, num_keys, values, found, NULL);
+}
+
+/**
+ * @brief Find the longest key in the trie that is a prefix of the input.
+ *
+ * @details
+ * Walk down the trie once along the input, remembering the deepest node with
+ * a value whose key has been matched completely.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] input The input supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_input Number of characters in the input.
+ * @param[out] value The value stored for the longest matching key.
+ * @param[out] match_len Length of the longest matching key.
+ *
+ * @return Boolean indicating if any key is a prefix of the input. value and
+ * match_len are left untouched if not.
+ */
+boolean longest_prefix_match (trie_t *trie, const char *input, size_t size_of_input,
+                              int *value, size_t *match_len)
+{
+    node_t *node, *prev;
+    lookup_step_t step;
+    size_t matched;
+    epoch_slot_t *slot;
+    unsigned long epoch;
+    boolean found;
+    
+    if (trie->concurrent) {
+        slot = epoch_enter(trie, &epoch);
+        found = concurrent_lookup(trie, input, size_of_input, value, match_len);
+        epoch_exit(trie, slot, epoch);
+        
+        return found;
+    }
+    slot = NULL;
+    if (trie->persistent) {
+        slot = epoch_enter(trie, &epoch);
+    }
+    node = __atomic_load_n(&trie->child, __ATOMIC_ACQUIRE);
+    matched = 0;
+    found = FALSE;
+    do {
+        prev = node;
+        step = lookup_step(trie, &node, input, size_of_input, &matched);
+        if ((step != LOOKUP_MISS) && prev->has_value) {
+            *value = prev->value;
+            *match_len = (step == LOOKUP_NEXT) ? matched - 1 : matched;
+            found = TRUE;
+        }
+    } while (step == LOOKUP_NEXT);
+    if (slot) {
+        epoch_exit(trie, slot, epoch);
+    }
+    
+    return found;
+}
+
+/**
+ * @brief Find the longest keys in the trie that are prefixes of a batch of inputs.
+ *
+ * @details
+ * The lookups of the batch overlap their cache misses, see batch_lookup().
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] inputs The inputs supplied to us, they need not be NUL terminated.
+ * @param[in] sizes sizes[i] is the number of characters in inputs[i].
+ * @param[in] num_inputs Number of inputs in the batch.
+ * @param[out] values values[i] is the value stored for the longest key that is
+ *             a prefix of inputs[i] if found[i] is TRUE.
+ * @param[out] match_lens match_lens[i] is the length of that key if found[i] is
+ *             TRUE.
+ * @param[out] found found[i] tells whether any key is a prefix of inputs[i].
+ */
+void longest_prefix_match_batch (trie_t *trie, const char **inputs, const size_t *sizes,
+                                 size_t num_inputs, int *values, size_t *match_lens,
+                                 boolean *found)
+{
+    batch_lookup(trie, inputs, sizes, num_inputs, values, found, match_lens);
+}
+
+/**
+ * @brief Delete the value stored in the trie for a particular key.
+ *
+ * @param[in] trie Poitner to trie.
+ * @param[in] key The key supplied to us.
+ *
+ * @return Boolean indicating if we deleted the key, value pair or not.
+ */
+boolean delete_from_trie (trie_t *trie, char *key)
+{
+    return delete_from_trie_len(trie, key, strlen(key));
+}
+
+/**
+ * @brief Delete the value stored in the trie for a key of a given length.
+ *
+ * @details
+ * Since every node other than the root either has a value or has multiple
+ * children, only the node holding the value and its parent can be affected.
+ * If the node has no children it is removed from its parent, and a node that
+ * is then left with a single child and no value is merged with that child.
+ *
+ * @param[in] trie Poitner to trie.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ *
+ * @return Boolean indicating if we deleted the key, value pair or not. Nothing
+ * is deleted if memory allocation failed.
+ */
+boolean delete_from_trie_len (trie_t *trie, const char *key, size_t size_of_key)
+{
+    if (trie->concurrent) {
+        epoch_slot_t *slot;
+        unsigned long epoch;
+        boolean done;
+        
+        slot = epoch_enter(trie, &epoch);
+        done = concurrent_delete(trie, key, size_of_key);
+        epoch_exit(trie, slot, epoch);
+        
+        return done;
+    }
+    
+    if (trie->persistent) {
+        return persistent_write(trie, key, size_of_key, 0, FALSE);
+    }
+    
+    return delete_from_root(trie, &trie->child, key, size_of_key);
+}
+
+/**
+ * @brief Destory the trie, deallocating the assosciate memory.
+ * 
+ * @details
+ * The trie doesn't need to be empty. A trie with an arena is released in one
+ * go, otherwise all the nodes are visited depth first and freed.
+ *
+ * @param[in, out] trie Pointer to the trie data structure.
+ */
+void destroy_trie (trie_t *trie)
+{
+    free(trie->path);
+    free_retired(trie);
+    free(trie->epoch_slots);
+    if (trie->arena) {
+        destroy_arena(trie->arena);
+        free(trie);
+        
+        return;
+    }
+    free_children(trie, trie->child);
+    free_node(trie, trie->child);
+    free(trie);
+}
+
+/**
+ * @brief Delete all the keys in the trie.
+ *
+ * @details
+ * All the nodes but the root are freed and the root is left with no value
+ * or children, so the trie can be filled up again right away.
+ * A persistent trie gets a new empty root instead, while snapshots keep the
+ * old version. It is left as it is if memory for the root can't be allocated.
+ *
+ * @param[in, out] trie Pointer to the trie data structure.
+ */
+void clear_trie (trie_t *trie)
+{
+    node_t *root;
+    
+    if (trie->persistent) {
+        root = alloc_node(trie, NODE_FULL, 0);
+        if (!root) {
+            return;
+        }
+        root = __atomic_exchange_n(&trie->child, root, __ATOMIC_ACQ_REL);
+        release_node(trie, root);
+        
+        return;
+    }
+    root = trie->child;
+    free_retired(trie);
+    free_children(trie, root);
+    memset((char *)root + sizeof(node_t), 0, node_size(trie, root->type) - sizeof(node_t));
+    root->num_children = 0;
+    root->has_value = FALSE;
+    root->value = 0;
+    root->max_value = INT_MIN;
+}
+
+
+/**
+ * @brief Take hold of the current version of a persistent trie.
+ *
+ * @details
+ * The version stays as it is, whatever is added to or deleted from the trie
+ * afterwards, until the snapshot is released. Taking a snapshot only takes a
+ * reference to the root of the version.
+ *
+ * @param[in] trie Pointer to the persistent trie.
+ *
+ * @return Pointer to the snapshot or NULL if memory allocation failed or the
+ * trie is not persistent.
+ */
+trie_snapshot_t *trie_snapshot (trie_t *trie)
+{
+    trie_snapshot_t *snapshot;
+    epoch_slot_t *slot;
+    unsigned long epoch;
+    unsigned int refs;
+    node_t *root;
+    
+    if (!trie->persistent) {
+        return NULL;
+    }
+    snapshot = (trie_snapshot_t *) malloc (sizeof(trie_snapshot_t));
+    if (!snapshot) {
+        return NULL;
+    }
+    
+    /*
+     * A root that has lost its last reference has just been replaced, so look
+     * again. It can't be freed while we are in the critical section.
+     */
+    slot = epoch_enter(trie, &epoch);
+    do {
+        root = __atomic_load_n(&trie->child, __ATOMIC_ACQUIRE);
+        refs = __atomic_load_n(&root->version, __ATOMIC_RELAXED);
+        while (refs && !__atomic_compare_exchange_n(&root->version, &refs, refs + 1, TRUE,
+                                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            ;
+        }
+    } while (!refs);
+    epoch_exit(trie, slot, epoch);
+    snapshot->trie = trie;
+    snapshot->root = root;
+    
+    return snapshot;
+}
+
+/**
+ * @brief Lookup a key in a snapshot of a persistent trie.
+ *
+ * @param[in] snapshot Pointer to the snapshot.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value The value found.
+ *
+ * @return Boolean indicating whether a value was found.
+ */
+boolean lookup_in_snapshot (trie_snapshot_t *snapshot, const char *key, size_t size_of_key,
+                            int *value)
+{
+    return lookup_from(snapshot->trie, snapshot->root, key, size_of_key, value);
+}
+
+/**
+ * @brief Let go of a snapshot of a persistent trie.
+ *
+ * @details
+ * The nodes only the snapshot referred to are freed once no lookup can be
+ * looking at them. All snapshots must be released before the trie is destroyed.
+ *
+ * @param[in] snapshot Pointer to the snapshot.
+ */
+void trie_snapshot_release (trie_snapshot_t *snapshot)
+{
+    release_node(snapshot->trie, snapshot->root);
+    free(snapshot);
+}
+
+/**
+ * @brief Start going through the keys with a particular prefix in order.
+ *
+ * @details
+ * Walk down to the node for the prefix, which may end part way through the
+ * prefix of a node, and set up a cursor that goes through the subtree below
+ * that node. Keys come out in the order of the alphabet of the trie.
+ * The trie must not be changed while the cursor is in use.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] prefix The prefix of the keys, it need not be NUL terminated.
+ * @param[in] size_of_prefix Number of characters in the prefix, 0 to go
+ *            through all the keys.
+ *
+ * @return Pointer to the cursor or NULL if memory allocation failed.
+ */
+trie_iter_t *trie_iter_prefix (trie_t *trie, const char *prefix, size_t size_of_prefix)
+{
+    trie_iter_t *iter;
+    node_t *node;
+    size_t key_len;
+    
+    iter = (trie_iter_t *)malloc(sizeof(trie_iter_t));
+    if (!iter) {
+        return NULL;
+    }
+    iter->trie = trie;
+    iter->depth = 0;
+    iter->stack_size = ITER_STACK_SIZE;
+    iter->key_size = ITER_KEY_SIZE;
+    iter->stack = (iter_frame_t *)malloc(sizeof(iter_frame_t) * iter->stack_size);
+    iter->key = (char *)malloc(iter->key_size);
+    if (!iter->stack || !iter->key) {
+        goto error_handling;
+    }
+    
+    node = find_prefix_node(trie, prefix, size_of_prefix, &key_len);
+    if (!node) {
+        return iter;
+    }
+    if (!reserve_key(&iter->key, &iter->key_size, key_len)) {
+        goto error_handling;
+    }
+    copy_prefix_key(trie, node, prefix, size_of_prefix, key_len, iter->key, key_len);
+    iter_push(iter, node, key_len);
+    
+    return iter;
+    
+error_handling:
+    trie_iter_destroy(iter);
+    return NULL;
+}
+
+/**
+ * @brief Move on to the next key of an iteration.
+ *
+ * @details
+ * The key is copied to the buffer of the caller, as much of it as fits. It is
+ * NUL terminated if there is room for that.
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer.
+ * @param[out] key_len Length of the whole key, which is more than key_size if
+ *             the key didn't fit.
+ * @param[out] value Value stored for the key.
+ *
+ * @return TRUE if there was another key or FALSE if the iteration is over or
+ * memory allocation failed.
+ */
+boolean trie_iter_next (trie_iter_t *iter, char *key, size_t key_size, size_t *key_len,
+                        int *value)
+{
+    iter_frame_t *frame;
+    node_t *node;
+    node_t **child_ref;
+    unsigned char index;
+    size_t len;
+    
+    while (iter->depth > 0) {
+        frame = &iter->stack[iter->depth - 1];
+        node = frame->node;
+        if (frame->next < 0) {
+            /*
+             * A key comes before all the keys it is a prefix of.
+             */
+            frame->next = 0;
+            if (node->has_value) {
+                len = frame->key_len;
+                memcpy(key, iter->key, (len < key_size) ? len : key_size);
+                if (len < key_size) {
+                    key[len] = '\0';
+                }
+                *key_len = len;
+                *value = node->value;
+                
+                return TRUE;
+            }
+        }
+        child_ref = next_child(iter->trie, node, frame->next, &index);
+        if (!child_ref) {
+            iter->depth--;
+            continue;
+        }
+        frame->next = index + 1;
+        len = frame->key_len;
+        if (!reserve_key(&iter->key, &iter->key_size, len + 1 + (*child_ref)->prefix_len) ||
+            !iter_push(iter, *child_ref, len + 1)) {
+            return FALSE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free a cursor.
+ *
+ * @param[in] iter Pointer to the cursor.
+ */
+void trie_iter_destroy (trie_iter_t *iter)
+{
+    free(iter->stack);
+    free(iter->key);
+    free(iter);
+}
+
+/**
+ * @brief Find the keys with a particular prefix that have the largest values.
+ *
+ * @details
+ * Every node caches the largest value stored in it or below it, so a best
+ * first search that always expands the most promising node or reports the
+ * biggest value seen so far gets to the k best keys after looking at the
+ * nodes on their way only, however many keys share the prefix.
+ * Keys come out in order of decreasing values, keys with equal values in no
+ * particular order.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] prefix The prefix of the keys, it need not be NUL terminated.
+ * @param[in] size_of_prefix Number of characters in the prefix.
+ * @param[in] k Number of keys wanted.
+ * @param[out] keys Buffer of k keys of key_size bytes each, the i-th key goes to
+ *             keys + i * key_size. A key is truncated if it doesn't fit and NUL
+ *             terminated if there is room for that. May be NULL if key_size is 0.
+ * @param[in] key_size Number of bytes for each key.
+ * @param[out] key_lens Lengths of the whole keys, or NULL.
+ * @param[out] values Values stored for the keys.
+ * @param[out] num_found Number of keys found, up to k.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+boolean top_k_in_trie (trie_t *trie, const char *prefix, size_t size_of_prefix, size_t k,
+                       char *keys, size_t key_size, size_t *key_lens, int *values,
+                       size_t *num_found)
+{
+    top_k_entry_t *heap;
+    top_k_visit_t *visits, *bigger_visits;
+    top_k_entry_t entry, child_entry;
+    node_t *node;
+    node_t **child_ref;
+    unsigned char index;
+    unsigned int j;
+    int from;
+    size_t heap_len, heap_size, num_visits, visits_size, base_len, len, pos, v;
+    char *key;
+    
+    *num_found = 0;
+    node = find_prefix_node(trie, prefix, size_of_prefix, &base_len);
+    if (!node || (k == 0)) {
+        return TRUE;
+    }
+    
+    heap_size = TOP_K_HEAP_SIZE;
+    visits_size = TOP_K_HEAP_SIZE;
+    heap = (top_k_entry_t *)malloc(sizeof(top_k_entry_t) * heap_size);
+    visits = (top_k_visit_t *)malloc(sizeof(top_k_visit_t) * visits_size);
+    if (!heap || !visits) {
+        goto error_handling;
+    }
+    heap_len = 0;
+    num_visits = 0;
+    
+    entry.score = node->max_value;
+    entry.is_value = FALSE;
+    entry.node = node;
+    entry.visit = 0;
+    entry.index = 0;
+    top_k_push(&heap, &heap_len, &heap_size, &entry);
+    while ((heap_len > 0) && (*num_found < k)) {
+        top_k_pop(heap, &heap_len, &entry);
+        if (entry.is_value) {
+            /*
+             * Work out the length of the key first and then fill it in backwards,
+             * following the visits up to the node for the prefix.
+             */
+            len = base_len;
+            for (v = entry.visit; v > 0; v = visits[v].parent) {
+                len += 1 + visits[v].node->prefix_len;
+            }
+            key = keys + *num_found * key_size;
+            pos = len;
+            for (v = entry.visit; v > 0; v = visits[v].parent) {
+                node = visits[v].node;
+                pos -= node->prefix_len;
+                for (j = 0; (j < node->prefix_len) && (pos + j < key_size); j++) {
+                    key[pos + j] = trie->index_to_char[node_prefix(trie, node)[j]];
+                }
+                pos--;
+                if (pos < key_size) {
+                    key[pos] = trie->index_to_char[visits[v].index];
+                }
+            }
+            copy_prefix_key(trie, visits[0].node, prefix, size_of_prefix, base_len, key,
+                            key_size);
+            if (len < key_size) {
+                key[len] = '\0';
+            }
+            if (key_lens) {
+                key_lens[*num_found] = len;
+            }
+            values[*num_found] = entry.score;
+            (*num_found)++;
+            continue;
+        }
+        
+        if (num_visits == visits_size) {
+            bigger_visits = (top_k_visit_t *)realloc(visits, sizeof(top_k_visit_t) *
+                                                     visits_size * 2);
+            if (!bigger_visits) {
+                goto error_handling;
+            }
+            visits = bigger_visits;
+            visits_size *= 2;
+        }
+        node = entry.node;
+        visits[num_visits].node = node;
+        visits[num_visits].parent = entry.visit;
+        visits[num_visits].index = entry.index;
+        if (node->has_value) {
+            child_entry.score = node->value;
+            child_entry.is_value = TRUE;
+            child_entry.node = NULL;
+            child_entry.visit = num_visits;
+            child_entry.index = 0;
+            if (!top_k_push(&heap, &heap_len, &heap_size, &child_entry)) {
+                goto error_handling;
+            }
+        }
+        for (from = 0; (child_ref = next_child(trie, node, from, &index)); from = index + 1) {
+            child_entry.score = (*child_ref)->max_value;
+            child_entry.is_value = FALSE;
+            child_entry.node = *child_ref;
+            child_entry.visit = num_visits;
+            child_entry.index = index;
+            if (!top_k_push(&heap, &heap_len, &heap_size, &child_entry)) {
+                goto error_handling;
+            }
+        }
+        num_visits++;
+    }
+    free(heap);
+    free(visits);
+    
+    return TRUE;
+    
+error_handling:
+    free(heap);
+    free(visits);
+    *num_found = 0;
+    return FALSE;
+}
+
+/**
+ * @brief Write a trie to a file that can be looked up in without loading it.
+ *
+ * @details
+ * The nodes are written depth first, each one after its children, so the
+ * offset of every child is known by the time its parent is written and the
+ * file is written in one go. Children refer to each other by offsets rather
+ * than pointers, see open_mapped_trie(). The trie must not be changed while
+ * it is saved.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] path Path of the file, replaced if it exists.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+boolean save_trie (trie_t *trie, const char *path)
+{
+    mapped_header_t header;
+    save_frame_t *stack, *bigger_stack, *frame;
+    node_t **child_ref;
+    FILE *file;
+    uint64_t offset, node_offset;
+    int depth, stack_size, i;
+    unsigned char index;
+    
+    stack = NULL;
+    file = fopen(path, "wb");
+    if (!file) {
+        return FALSE;
+    }
+    memset(&header, 0, sizeof(mapped_header_t));
+    if (fwrite(&header, sizeof(mapped_header_t), 1, file) != 1) {
+        goto error_handling;
+    }
+    offset = sizeof(mapped_header_t);
+    
+    stack_size = ITER_STACK_SIZE;
+    stack = (save_frame_t *)malloc(sizeof(save_frame_t) * stack_size);
+    if (!stack) {
+        goto error_handling;
+    }
+    stack[0].node = trie->child;
+    stack[0].next = 0;
+    stack[0].num_children = 0;
+    depth = 1;
+    node_offset = 0;
+    while (depth > 0) {
+        frame = &stack[depth - 1];
+        child_ref = next_child(trie, frame->node, frame->next, &index);
+        if (child_ref) {
+            frame->next = index + 1;
+            if (depth == stack_size) {
+                bigger_stack = (save_frame_t *)realloc(stack, sizeof(save_frame_t) *
+                                                       stack_size * 2);
+                if (!bigger_stack) {
+                    goto error_handling;
+                }
+                stack = bigger_stack;
+                stack_size *= 2;
+            }
+            stack[depth].node = *child_ref;
+            stack[depth].next = 0;
+            stack[depth].num_children = 0;
+            depth++;
+            continue;
+        }
+        
+        node_offset = write_mapped_node(trie, file, frame, &offset);
+        if (!node_offset) {
+            goto error_handling;
+        }
+        depth--;
+        if (depth > 0) {
+            frame = &stack[depth - 1];
+            frame->child[frame->num_children] = node_offset;
+            frame->key[frame->num_children] = (unsigned char)(frame->next - 1);
+            frame->num_children++;
+        }
+    }
+    free(stack);
+    stack = NULL;
+    
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(header.magic));
+    header.version = MAPPED_VERSION;
+    header.byte_order = MAPPED_BYTE_ORDER;
+    header.size = offset;
+    header.root = node_offset;
+    for (i = 0; i < MAX_NUM_CHILD; i++) {
+        header.char_to_index[i] = trie->char_to_index[i];
+    }
+    if (fseek(file, 0, SEEK_SET) ||
+        (fwrite(&header, sizeof(mapped_header_t), 1, file) != 1)) {
+        goto error_handling;
+    }
+    if (fclose(file)) {
+        remove(path);
+        return FALSE;
+    }
+    
+    return TRUE;
+    
+error_handling:
+    free(stack);
+    fclose(file);
+    remove(path);
+    return FALSE;
+}
+
+/**
+ * @brief Map a file written by save_trie() into memory.
+ *
+ * @details
+ * Nothing is read up front, lookups are served straight out of the mapping
+ * and only touch the pages of the nodes they go through. The mapping is
+ * shared, so processes that map the same file share its pages. The file must
+ * have been written on a machine with the same byte order and must not be
+ * changed while it is mapped.
+ *
+ * @param[in] path Path of the file.
+ *
+ * @return Pointer to the mapped trie or NULL if the file couldn't be mapped
+ * or wasn't written by save_trie().
+ */
+mapped_trie_t *open_mapped_trie (const char *path)
+{
+    mapped_trie_t *mtrie;
+    const mapped_header_t *header;
+    struct stat st;
+    void *base;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(mapped_header_t))) {
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    
+    header = (const mapped_header_t *)base;
+    if (memcmp(header->magic, MAPPED_MAGIC, sizeof(header->magic)) ||
+        (header->version != MAPPED_VERSION) ||
+        (header->byte_order != MAPPED_BYTE_ORDER) ||
+        (header->size != (uint64_t)st.st_size)) {
+        goto error_handling;
+    }
+    
+    mtrie = (mapped_trie_t *)malloc(sizeof(mapped_trie_t));
+    if (!mtrie) {
+        goto error_handling;
+    }
+    mtrie->base = (const unsigned char *)base;
+    mtrie->size = (size_t)st.st_size;
+    mtrie->root = mapped_node_at(mtrie, header->root);
+    mtrie->char_to_index = header->char_to_index;
+    if (!mtrie->root) {
+        free(mtrie);
+        goto error_handling;
+    }
+    
+    return mtrie;
+    
+error_handling:
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+}
+
+/**
+ * @brief Lookup a key in a mapped trie.
+ *
+ * @param[in] mtrie Pointer to the mapped trie.
+ * @param[in] key The key, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value Value stored for the key.
+ *
+ * @return Boolean indicating if the key was found or not.
+ */
+boolean lookup_in_mapped_trie (mapped_trie_t *mtrie, const char *key, size_t size_of_key,
+                               int *value)
+{
+    const mapped_node_t *node;
+    const unsigned char *prefix;
+    unsigned short index;
+    size_t matched;
+    unsigned int i;
+    
+    node = mtrie->root;
+    matched = 0;
+    for (;;) {
+        prefix = (const unsigned char *)((const uint64_t *)(node + 1) + node->num_children) +
+                 node->num_children;
+        if (node->prefix_len > size_of_key - matched) {
+            return FALSE;
+        }
+        for (i = 0; i < node->prefix_len; i++) {
+            if (mtrie->char_to_index[(unsigned char)key[matched + i]] != prefix[i]) {
+                return FALSE;
+            }
+        }
+        matched += node->prefix_len;
+        if (matched == size_of_key) {
+            if (!node->has_value) {
+                return FALSE;
+            }
+            *value = node->value;
+            
+            return TRUE;
+        }
+        
+        index = mtrie->char_to_index[(unsigned char)key[matched++]];
+        if (index == INVALID_INDEX) {
+            return FALSE;
+        }
+        node = find_mapped_child(mtrie, node, (unsigned char)index);
+        if (!node) {
+            return FALSE;
+        }
+    }
+}
+
+/**
+ * @brief Unmap a mapped trie.
+ *
+ * @param[in] mtrie Pointer to the mapped trie.
+ */
+void close_mapped_trie (mapped_trie_t *mtrie)
+{
+    munmap((void *)mtrie->base, mtrie->size);
+    free(mtrie);
+}
+
+/**
+ * @brief Make a compact read only copy of a trie.
+ *
+ * @details
+ * The nodes are laid out breadth first, so the children of a node are next
+ * to each other and near its siblings' children, and a node takes 20 bytes
+ * plus a bitmap of the alphabet if it has children and its prefix. The trie
+ * must not be changed while it is frozen and is left as it is.
+ *
+ * @param[in] trie Pointer to trie.
+ *
+ * @return Pointer to the frozen trie or NULL if memory allocation failed or
+ * the trie is too big to be addressed with 32 bit indices.
+ */
+frozen_trie_t *freeze_trie (trie_t *trie)
+{
+    frozen_trie_t *frozen;
+    frozen_node_t *frozen_node;
+    node_t **order, **child_ref;
+    node_t *node;
+    size_t num_nodes, num_parents, prefix_size, i;
+    uint32_t next_node, next_word, next_prefix;
+    unsigned char index;
+    
+    frozen = NULL;
+    order = breadth_first_order(trie, &num_nodes);
+    if (!order) {
+        return NULL;
+    }
+    num_parents = 0;
+    prefix_size = 0;
+    for (i = 0; i < num_nodes; i++) {
+        num_parents += node_has_children(order[i]);
+        prefix_size += order[i]->prefix_len;
+    }
+    
+    frozen = (frozen_trie_t *)malloc(sizeof(frozen_trie_t));
+    if (!frozen) {
+        goto error_handling;
+    }
+    frozen->bitmap_words = (trie->alphabet_size + FROZEN_WORD_BITS - 1) / FROZEN_WORD_BITS;
+    if ((num_nodes > UINT32_MAX) || (prefix_size > UINT32_MAX) ||
+        ((num_parents + 1) * frozen->bitmap_words > UINT32_MAX)) {
+        free(frozen);
+        frozen = NULL;
+        goto error_handling;
+    }
+    frozen->nodes = (frozen_node_t *)malloc(sizeof(frozen_node_t) * num_nodes);
+    frozen->bitmaps = (uint64_t *)calloc((num_parents + 1) * frozen->bitmap_words,
+                                         sizeof(uint64_t));
+    frozen->prefixes = (unsigned char *)malloc(prefix_size + 1);
+    if (!frozen->nodes || !frozen->bitmaps || !frozen->prefixes) {
+        goto error_handling;
+    }
+    memcpy(frozen->char_to_index, trie->char_to_index, sizeof(frozen->char_to_index));
+    memcpy(frozen->index_to_char, trie->index_to_char, sizeof(frozen->index_to_char));
+    
+    next_node = 1;
+    next_word = frozen->bitmap_words;
+    next_prefix = 0;
+    for (i = 0; i < num_nodes; i++) {
+        node = order[i];
+        frozen_node = &frozen->nodes[i];
+        frozen_node->first_child = next_node;
+        frozen_node->bitmap = 0;
+        frozen_node->prefix = next_prefix;
+        frozen_node->prefix_len = node->prefix_len;
+        frozen_node->has_value = node->has_value ? 1 : 0;
+        frozen_node->value = node->value;
+        memcpy(frozen->prefixes + next_prefix, node_prefix(trie, node), node->prefix_len);
+        next_prefix += node->prefix_len;
+        for (child_ref = next_child(trie, node, 0, &index); child_ref;
+             child_ref = next_child(trie, node, index + 1, &index)) {
+            if (!frozen_node->bitmap) {
+                frozen_node->bitmap = next_word;
+                next_word += frozen->bitmap_words;
+            }
+            frozen->bitmaps[frozen_node->bitmap + index / FROZEN_WORD_BITS] |=
+                (uint64_t)1 << (index % FROZEN_WORD_BITS);
+            next_node++;
+        }
+    }
+    free(order);
+    
+    return frozen;
+    
+error_handling:
+    if (frozen) {
+        destroy_frozen_trie(frozen);
+    }
+    free(order);
+    return NULL;
+}
+
+/**
+ * @brief Lookup a key in a frozen trie.
+ *
+ * @param[in] frozen Pointer to the frozen trie.
+ * @param[in] key The key, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value Value stored for the key.
+ *
+ * @return Boolean indicating if the key was found or not.
+ */
+boolean lookup_in_frozen_trie (frozen_trie_t *frozen, const char *key, size_t size_of_key,
+                               int *value)
+{
+    frozen_node_t *node;
+    unsigned char *prefix;
+    size_t matched;
+    unsigned int i;
+    
+    node = frozen->nodes;
+    matched = 0;
+    for (;;) {
+        if (node->prefix_len > size_of_key - matched) {
+            return FALSE;
+        }
+        prefix = frozen->prefixes + node->prefix;
+        for (i = 0; i < node->prefix_len; i++) {
+            if (frozen->char_to_index[(unsigned char)key[matched + i]] != prefix[i]) {
+                return FALSE;
+            }
+        }
+        matched += node->prefix_len;
+        if (matched == size_of_key) {
+            if (!node->has_value) {
+                return FALSE;
+            }
+            *value = node->value;
+            
+            return TRUE;
+        }
+        
+        node = find_frozen_child(frozen, node,
+                                 frozen->char_to_index[(unsigned char)key[matched++]]);
+        if (!node) {
+            return FALSE;
+        }
+    }
+}
+
+/**
+ * @brief Free a frozen trie.
+ *
+ * @param[in] frozen Pointer to the frozen trie.
+ */
+void destroy_frozen_trie (frozen_trie_t *frozen)
+{
+    free(frozen->nodes);
+    free(frozen->bitmaps);
+    free(frozen->prefixes);
+    free(frozen);
+}
+
+/**
+ * @brief Start going through the keys of a frozen trie with a particular
+ * prefix in order.
+ *
+ * @details
+ * Keys come out in the same order as with trie_iter_prefix().
+ *
+ * @param[in] frozen Pointer to the frozen trie.
+ * @param[in] prefix The prefix of the keys, it need not be NUL terminated.
+ * @param[in] size_of_prefix Number of characters in the prefix, 0 to go
+ *            through all the keys.
+ *
+ * @return Pointer to the cursor or NULL if memory allocation failed.
+ */
+frozen_iter_t *frozen_trie_iter_prefix (frozen_trie_t *frozen, const char *prefix,
+                                        size_t size_of_prefix)
+{
+    frozen_iter_t *iter;
+    frozen_node_t *node;
+    unsigned char *node_prefix;
+    size_t matched, rest;
+    unsigned int i;
+    
+    iter = (frozen_iter_t *)malloc(sizeof(frozen_iter_t));
+    if (!iter) {
+        return NULL;
+    }
+    iter->frozen = frozen;
+    iter->depth = 0;
+    iter->stack_size = ITER_STACK_SIZE;
+    iter->key_size = ITER_KEY_SIZE;
+    iter->stack = (frozen_frame_t *)malloc(sizeof(frozen_frame_t) * iter->stack_size);
+    iter->key = (char *)malloc(iter->key_size);
+    if (!iter->stack || !iter->key) {
+        goto error_handling;
+    }
+    
+    /*
+     * Walk down to the node for the prefix, which may end part way through the
+     * prefix of a node.
+     */
+    node = frozen->nodes;
+    matched = 0;
+    for (;;) {
+        node_prefix = frozen->prefixes + node->prefix;
+        rest = size_of_prefix - matched;
+        for (i = 0; (i < node->prefix_len) && (i < rest); i++) {
+            if (frozen->char_to_index[(unsigned char)prefix[matched + i]] != node_prefix[i]) {
+                return iter;
+            }
+        }
+        if (node->prefix_len >= rest) {
+            break;
+        }
+        matched += node->prefix_len;
+        node = find_frozen_child(frozen, node,
+                                 frozen->char_to_index[(unsigned char)prefix[matched++]]);
+        if (!node) {
+            return iter;
+        }
+    }
+    if (!reserve_key(&iter->key, &iter->key_size, matched + node->prefix_len)) {
+        goto error_handling;
+    }
+    memcpy(iter->key, prefix, matched);
+    for (i = 0; i < node->prefix_len; i++) {
+        iter->key[matched + i] = frozen->index_to_char[node_prefix[i]];
+    }
+    frozen_iter_push(iter, (uint32_t)(node - frozen->nodes), matched + node->prefix_len);
+    
+    return iter;
+    
+error_handling:
+    frozen_trie_iter_destroy(iter);
+    return NULL;
+}
+
+/**
+ * @brief Move on to the next key of an iteration of a frozen trie.
+ *
+ * @details
+ * As trie_iter_next().
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer.
+ * @param[out] key_len Length of the whole key, which is more than key_size if
+ *             the key didn't fit.
+ * @param[out] value Value stored for the key.
+ *
+ * @return TRUE if there was another key or FALSE if the iteration is over or
+ * memory allocation failed.
+ */
+boolean frozen_trie_iter_next (frozen_iter_t *iter, char *key, size_t key_size,
+                               size_t *key_len, int *value)
+{
+    frozen_frame_t *frame;
+    frozen_node_t *node;
+    uint32_t child;
+    size_t len;
+    int index;
+    
+    while (iter->depth > 0) {
+        frame = &iter->stack[iter->depth - 1];
+        node = &iter->frozen->nodes[frame->node];
+        if (frame->next < 0) {
+            frame->next = 0;
+            if (node->has_value) {
+                len = frame->key_len;
+                memcpy(key, iter->key, (len < key_size) ? len : key_size);
+                if (len < key_size) {
+                    key[len] = '\0';
+                }
+                *key_len = len;
+                *value = node->value;
+                
+                return TRUE;
+            }
+        }
+        index = next_frozen_index(iter->frozen, node, frame->next);
+        if (index < 0) {
+            iter->depth--;
+            continue;
+        }
+        frame->next = index + 1;
+        child = frame->child++;
+        len = frame->key_len;
+        if (!reserve_key(&iter->key, &iter->key_size,
+                         len + 1 + iter->frozen->nodes[child].prefix_len) ||
+            !frozen_iter_push(iter, child, len + 1)) {
+            return FALSE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free a cursor of a frozen trie.
+ *
+ * @param[in] iter Pointer to the cursor.
+ */
+void frozen_trie_iter_destroy (frozen_iter_t *iter)
+{
+    free(iter->stack);
+    free(iter->key);
+    free(iter);
+}
+
+/**
+ * @brief Make a succinct read only copy of a trie.
+ *
+ * @details
+ * The shape of the trie takes a little over 2 bits per node, see louds_trie_s,
+ * and each node takes one more byte for the key index on the edge to it and
+ * 2 bits to tell if it has a value and a prefix. Values and prefixes are kept
+ * for the nodes that have them only. Finding the children of a node takes a
+ * few word operations, so lookups are slower than with a frozen trie. The
+ * trie must not be changed while it is copied and is left as it is.
+ *
+ * @param[in] trie Pointer to trie.
+ *
+ * @return Pointer to the LOUDS trie or NULL if memory allocation failed or
+ * the trie is too big to be addressed with 32 bit positions.
+ */
+louds_trie_t *build_louds_trie (trie_t *trie)
+{
+    louds_trie_t *louds;
+    node_t **order, **child_ref;
+    node_t *node;
+    size_t num_nodes, num_values, num_prefixes, prefix_size, pos, i;
+    uint32_t next_prefix;
+    unsigned char index;
+    
+    order = breadth_first_order(trie, &num_nodes);
+    if (!order) {
+        return NULL;
+    }
+    louds = (louds_trie_t *)calloc(1, sizeof(louds_trie_t));
+    if (!louds) {
+        free(order);
+        return NULL;
+    }
+    num_values = 0;
+    num_prefixes = 0;
+    prefix_size = 0;
+    for (i = 0; i < num_nodes; i++) {
+        num_values += order[i]->has_value;
+        num_prefixes += (order[i]->prefix_len > 0);
+        prefix_size += order[i]->prefix_len;
+    }
+    if ((2 * num_nodes + 1 > UINT32_MAX) || (prefix_size > UINT32_MAX) ||
+        !init_bitvector(&louds->louds, 2 * num_nodes + 1) ||
+        !init_bitvector(&louds->has_value, num_nodes) ||
+        !init_bitvector(&louds->has_prefix, num_nodes)) {
+        goto error_handling;
+    }
+    louds->labels = (unsigned char *)malloc(num_nodes);
+    louds->values = (int *)malloc(sizeof(int) * (num_values + 1));
+    louds->prefix_starts = (uint32_t *)malloc(sizeof(uint32_t) * (num_prefixes + 1));
+    louds->prefixes = (unsigned char *)malloc(prefix_size + 1);
+    if (!louds->labels || !louds->values || !louds->prefix_starts || !louds->prefixes) {
+        goto error_handling;
+    }
+    memcpy(louds->char_to_index, trie->char_to_index, sizeof(louds->char_to_index));
+    memcpy(louds->index_to_char, trie->index_to_char, sizeof(louds->index_to_char));
+    
+    /*
+     * The super root, then the children of each node. A child's number is its
+     * place in the breadth first order, so its label is known as soon as the
+     * 1 standing for it is written.
+     */
+    louds->louds.words[0] = 1;
+    pos = 2;
+    louds->labels[0] = 0;
+    num_values = 0;
+    num_prefixes = 0;
+    next_prefix = 0;
+    for (i = 0; i < num_nodes; i++) {
+        node = order[i];
+        for (child_ref = next_child(trie, node, 0, &index); child_ref;
+             child_ref = next_child(trie, node, index + 1, &index)) {
+            louds->labels[pos - i - 1] = index;
+            louds->louds.words[pos / 64] |= (uint64_t)1 << (pos % 64);
+            pos++;
+        }
+        pos++;
+        if (node->has_value) {
+            louds->has_value.words[i / 64] |= (uint64_t)1 << (i % 64);
+            louds->values[num_values++] = node->value;
+        }
+        if (node->prefix_len) {
+            louds->has_prefix.words[i / 64] |= (uint64_t)1 << (i % 64);
+            louds->prefix_starts[num_prefixes++] = next_prefix;
+            memcpy(louds->prefixes + next_prefix, node_prefix(trie, node), node->prefix_len);
+            next_prefix += node->prefix_len;
+        }
+    }
+    louds->prefix_starts[num_prefixes] = next_prefix;
+    if (!index_bitvector(&louds->louds, TRUE) ||
+        !index_bitvector(&louds->has_value, FALSE) ||
+        !index_bitvector(&louds->has_prefix, FALSE)) {
+        goto error_handling;
+    }
+    free(order);
+    
+    return louds;
+    
+error_handling:
+    destroy_louds_trie(louds);
+    free(order);
+    return NULL;
+}
+
+/**
+ * @brief Lookup a key in a LOUDS trie.
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ * @param[in] key The key, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value Value stored for the key.
+ *
+ * @return Boolean indicating if the key was found or not.
+ */
+boolean lookup_in_louds_trie (louds_trie_t *louds, const char *key, size_t size_of_key,
+                              int *value)
+{
+    unsigned char *prefix;
+    uint32_t node, prefix_len, i;
+    size_t matched;
+    
+    node = 0;
+    matched = 0;
+    for (;;) {
+        prefix_len = louds_prefix(louds, node, &prefix);
+        if (prefix_len > size_of_key - matched) {
+            return FALSE;
+        }
+        for (i = 0; i < prefix_len; i++) {
+            if (louds->char_to_index[(unsigned char)key[matched + i]] != prefix[i]) {
+                return FALSE;
+            }
+        }
+        matched += prefix_len;
+        if (matched == size_of_key) {
+            if (!(louds->has_value.words[node / 64] & ((uint64_t)1 << (node % 64)))) {
+                return FALSE;
+            }
+            *value = louds->values[rank_bitvector(&louds->has_value, node)];
+            
+            return TRUE;
+        }
+        
+        if (!find_louds_child(louds, &node,
+                              louds->char_to_index[(unsigned char)key[matched++]])) {
+            return FALSE;
+        }
+    }
+}
+
+/**
+ * @brief Free a LOUDS trie.
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ */
+void destroy_louds_trie (louds_trie_t *louds)
+{
+    free_bitvector(&louds->louds);
+    free_bitvector(&louds->has_value);
+    free_bitvector(&louds->has_prefix);
+    free(louds->labels);
+    free(louds->values);
+    free(louds->prefix_starts);
+    free(louds->prefixes);
+    free(louds);
+}
+
+/**
+ * @brief Start going through the keys of a LOUDS trie with a particular
+ * prefix in order.
+ *
+ * @details
+ * Keys come out in the same order as with trie_iter_prefix().
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ * @param[in] prefix The prefix of the keys, it need not be NUL terminated.
+ * @param[in] size_of_prefix Number of characters in the prefix, 0 to go
+ *            through all the keys.
+ *
+ * @return Pointer to the cursor or NULL if memory allocation failed.
+ */
+louds_iter_t *louds_trie_iter_prefix (louds_trie_t *louds, const char *prefix,
+                                      size_t size_of_prefix)
+{
+    louds_iter_t *iter;
+    unsigned char *node_prefix;
+    uint32_t node, prefix_len, i;
+    size_t matched, rest;
+    
+    iter = (louds_iter_t *)malloc(sizeof(louds_iter_t));
+    if (!iter) {
+        return NULL;
+    }
+    iter->louds = louds;
+    iter->depth = 0;
+    iter->stack_size = ITER_STACK_SIZE;
+    iter->key_size = ITER_KEY_SIZE;
+    iter->stack = (louds_frame_t *)malloc(sizeof(louds_frame_t) * iter->stack_size);
+    iter->key = (char *)malloc(iter->key_size);
+    if (!iter->stack || !iter->key) {
+        goto error_handling;
+    }
+    
+    /*
+     * Walk down to the node for the prefix, which may end part way through the
+     * prefix of a node.
+     */
+    node = 0;
+    matched = 0;
+    for (;;) {
+        prefix_len = louds_prefix(louds, node, &node_prefix);
+        rest = size_of_prefix - matched;
+        for (i = 0; (i < prefix_len) && (i < rest); i++) {
+            if (louds->char_to_index[(unsigned char)prefix[matched + i]] != node_prefix[i]) {
+                return iter;
+            }
+        }
+        if (prefix_len >= rest) {
+            break;
+        }
+        matched += prefix_len;
+        if (!find_louds_child(louds, &node,
+                              louds->char_to_index[(unsigned char)prefix[matched++]])) {
+            return iter;
+        }
+    }
+    if (!reserve_key(&iter->key, &iter->key_size, matched + prefix_len)) {
+        goto error_handling;
+    }
+    memcpy(iter->key, prefix, matched);
+    for (i = 0; i < prefix_len; i++) {
+        iter->key[matched + i] = louds->index_to_char[node_prefix[i]];
+    }
+    louds_iter_push(iter, node, matched + prefix_len);
+    
+    return iter;
+    
+error_handling:
+    louds_trie_iter_destroy(iter);
+    return NULL;
+}
+
+/**
+ * @brief Move on to the next key of an iteration of a LOUDS trie.
+ *
+ * @details
+ * As trie_iter_next().
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer.
+ * @param[out] key_len Length of the whole key, which is more than key_size if
+ *             the key didn't fit.
+ * @param[out] value Value stored for the key.
+ *
+ * @return TRUE if there was another key or FALSE if the iteration is over or
+ * memory allocation failed.
+ */
+boolean louds_trie_iter_next (louds_iter_t *iter, char *key, size_t key_size,
+                              size_t *key_len, int *value)
+{
+    louds_trie_t *louds;
+    louds_frame_t *frame;
+    unsigned char *prefix;
+    uint32_t child;
+    size_t len;
+    
+    louds = iter->louds;
+    while (iter->depth > 0) {
+        frame = &iter->stack[iter->depth - 1];
+        if (!frame->visited) {
+            frame->visited = TRUE;
+            if (louds->has_value.words[frame->node / 64] &
+                ((uint64_t)1 << (frame->node % 64))) {
+                len = frame->key_len;
+                memcpy(key, iter->key, (len < key_size) ? len : key_size);
+                if (len < key_size) {
+                    key[len] = '\0';
+                }
+                *key_len = len;
+                *value = louds->values[rank_bitvector(&louds->has_value, frame->node)];
+                
+                return TRUE;
+            }
+        }
+        if (frame->next == frame->end) {
+            iter->depth--;
+            continue;
+        }
+        child = (uint32_t)(frame->next++ - frame->node - 1);
+        len = frame->key_len;
+        if (!reserve_key(&iter->key, &iter->key_size,
+                         len + 1 + louds_prefix(louds, child, &prefix)) ||
+            !louds_iter_push(iter, child, len + 1)) {
+            return FALSE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free a cursor of a LOUDS trie.
+ *
+ * @param[in] iter Pointer to the cursor.
+ */
+void louds_trie_iter_destroy (louds_iter_t *iter)
+{
+    free(iter->stack);
+    free(iter->key);
+    free(iter);
+}
+
+/**
+ * @brief Make a double-array copy of a trie.
+ *
+ * @details
+ * Every character of a key is a state of its own, so the prefixes of nodes
+ * are spread out over a chain of states. The children of each state are
+ * placed at the first offset where all the cells they need are free, going
+ * through the free cells in order and giving up on cells that didn't fit
+ * DOUBLE_ARRAY_MAX_FAILURES times. The trie must not be changed while it is
+ * copied and is left as it is.
+ *
+ * @param[in] trie Pointer to trie.
+ *
+ * @return Pointer to the double-array trie or NULL if memory allocation
+ * failed or the trie is too big to be addressed with 32 bit states.
+ */
+double_array_trie_t *build_double_array_trie (trie_t *trie)
+{
+    double_array_builder_t builder;
+    double_array_trie_t *da;
+    double_array_item_t *stack, *bigger_stack, item;
+    node_t **child_ref;
+    int32_t base, cell;
+    size_t depth, stack_size;
+    int codes[MAX_NUM_CHILD + 1];
+    int num_codes, i;
+    unsigned char index;
+    
+    memset(&builder, 0, sizeof(double_array_builder_t));
+    builder.free_head = -1;
+    builder.free_tail = -1;
+    stack = NULL;
+    da = (double_array_trie_t *)calloc(1, sizeof(double_array_trie_t));
+    if (!da) {
+        return NULL;
+    }
+    builder.da = da;
+    memcpy(da->char_to_index, trie->char_to_index, sizeof(da->char_to_index));
+    stack_size = ITER_STACK_SIZE;
+    stack = (double_array_item_t *)malloc(sizeof(double_array_item_t) * stack_size);
+    if (!stack || !grow_double_array(&builder, DOUBLE_ARRAY_SIZE)) {
+        goto error_handling;
+    }
+    
+    /*
+     * The root is state 0, which no child can be placed at.
+     */
+    take_double_array_cell(&builder, 0);
+    da->check[0] = DOUBLE_ARRAY_ROOT;
+    stack[0].node = trie->child;
+    stack[0].offset = 0;
+    stack[0].state = 0;
+    depth = 1;
+    while (depth > 0) {
+        item = stack[--depth];
+        num_codes = 0;
+        if (item.offset < item.node->prefix_len) {
+            codes[num_codes++] = node_prefix(trie, item.node)[item.offset] + 1;
+        } else {
+            if (item.node->has_value) {
+                codes[num_codes++] = 0;
+            }
+            for (child_ref = next_child(trie, item.node, 0, &index); child_ref;
+                 child_ref = next_child(trie, item.node, index + 1, &index)) {
+                codes[num_codes++] = index + 1;
+            }
+        }
+        if (!num_codes) {
+            /*
+             * An empty root, the base only has to stay inside the array.
+             */
+            da->base[item.state] = 1;
+            continue;
+        }
+        if (!find_double_array_base(&builder, codes, num_codes, &base)) {
+            goto error_handling;
+        }
+        da->base[item.state] = base;
+        while (depth + num_codes > stack_size) {
+            bigger_stack = (double_array_item_t *)realloc(stack, sizeof(double_array_item_t) *
+                                                          stack_size * 2);
+            if (!bigger_stack) {
+                goto error_handling;
+            }
+            stack = bigger_stack;
+            stack_size *= 2;
+        }
+        
+        /*
+         * The children are the chain of the prefix or the terminator and
+         * the children of the node, in the same order as the codes.
+         */
+        child_ref = NULL;
+        for (i = 0; i < num_codes; i++) {
+            cell = base + codes[i];
+            take_double_array_cell(&builder, cell);
+            da->check[cell] = item.state;
+            if (!codes[i]) {
+                da->base[cell] = item.node->value;
+                continue;
+            }
+            if (item.offset < item.node->prefix_len) {
+                stack[depth].node = item.node;
+                stack[depth].offset = item.offset + 1;
+            } else {
+                child_ref = child_ref ? next_child(trie, item.node, index + 1, &index) :
+                                        next_child(trie, item.node, 0, &index);
+                stack[depth].node = *child_ref;
+                stack[depth].offset = 0;
+            }
+            stack[depth].state = cell;
+            depth++;
+        }
+    }
+    
+    /*
+     * Room for the biggest code past the biggest base, so that lookups never
+     * have to check that they are still inside the array.
+     */
+    if (!grow_double_array(&builder, (size_t)builder.max_base + MAX_NUM_CHILD + 1)) {
+        goto error_handling;
+    }
+    free(builder.next_free);
+    free(builder.prev_free);
+    free(builder.failures);
+    free(stack);
+    
+    return da;
+    
+error_handling:
+    free(builder.next_free);
+    free(builder.prev_free);
+    free(builder.failures);
+    free(stack);
+    destroy_double_array_trie(da);
+    return NULL;
+}
+
+/**
+ * @brief Make a double-array trie out of a list of keys.
+ *
+ * @param[in] alphabet The characters permitted in keys with no duplicates, or
+ *            TRIE_ALPHABET_BYTES for all 256 byte values.
+ * @param[in] keys The keys, they need not be NUL terminated. A key that comes
+ *            up more than once gets the last of its values.
+ * @param[in] sizes Number of characters in each key.
+ * @param[in] values Value of each key.
+ * @param[in] num_keys Number of keys.
+ *
+ * @return Pointer to the double-array trie or NULL if memory allocation
+ * failed, the alphabet is not valid or a key has a character that isn't in
+ * the alphabet.
+ */
+double_array_trie_t *build_double_array_from_keys (const char *alphabet, const char **keys,
+                                                   const size_t *sizes, const int *values,
+                                                   size_t num_keys)
+{
+    double_array_trie_t *da;
+    trie_t *trie;
+    size_t i;
+    
+    trie = create_trie_with_alphabet(alphabet, TRUE);
+    if (!trie) {
+        return NULL;
+    }
+    for (i = 0; i < num_keys; i++) {
+        if (!add_to_trie_len(keys[i], sizes[i], values[i], trie)) {
+            destroy_trie(trie);
+            return NULL;
+        }
+    }
+    da = build_double_array_trie(trie);
+    destroy_trie(trie);
+    
+    return da;
+}
+
+/**
+ * @brief Lookup a key in a double-array trie.
+ *
+ * @details
+ * Each character takes the state to base + code of the current state, which
+ * is a child of the current state only if its check says so.
+ *
+ * @param[in] da Pointer to the double-array trie.
+ * @param[in] key The key, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value Value stored for the key.
+ *
+ * @return Boolean indicating if the key was found or not.
+ */
+boolean lookup_in_double_array_trie (double_array_trie_t *da, const char *key,
+                                     size_t size_of_key, int *value)
+{
+    int32_t state, next;
+    unsigned short index;
+    size_t i;
+    
+    state = 0;
+    for (i = 0; i < size_of_key; i++) {
+        index = da->char_to_index[(unsigned char)key[i]];
+        if (index == INVALID_INDEX) {
+            return FALSE;
+        }
+        next = da->base[state] + index + 1;
+        if (da->check[next] != state) {
+            return FALSE;
+        }
+        state = next;
+    }
+    next = da->base[state];
+    if (da->check[next] != state) {
+        return FALSE;
+    }
+    *value = da->base[next];
+    
+    return TRUE;
+}
+
+/**
+ * @brief Free a double-array trie.
+ *
+ * @param[in] da Pointer to the double-array trie.
+ */
+void destroy_double_array_trie (double_array_trie_t *da)
+{
+    free(da->base);
+    free(da->check);
+    free(da);
+}
+
+/**
+ * @brief Start loading keys into an empty trie in order.
+ *
+ * @details
+ * A loader keeps the nodes on the way to the last key added open, as the
+ * next keys may still go below them. A node is only made once no key can go
+ * below it any more, with all of its children and the right type from the
+ * start. Each key only touches the nodes where it parts from the previous
+ * one, and the nodes come out one after the other, so with an arena the
+ * nodes of neighbouring keys end up next to each other. The trie must not be
+ * used until the loader is finished.
+ *
+ * @param[in] trie Pointer to the trie. It must be empty.
+ *
+ * @return Pointer to the loader or NULL if memory allocation failed or the
+ * trie is not empty.
+ */
+trie_loader_t *trie_loader_create (trie_t *trie)
+{
+    trie_loader_t *loader;
+    
+    if (node_has_children(trie->child) || trie->child->has_value) {
+        return NULL;
+    }
+    loader = (trie_loader_t *)calloc(1, sizeof(trie_loader_t));
+    if (!loader) {
+        return NULL;
+    }
+    loader->trie = trie;
+    loader->stack_size = ITER_STACK_SIZE;
+    loader->key_size = ITER_KEY_SIZE;
+    loader->next_key_size = ITER_KEY_SIZE;
+    loader->stack = (load_frame_t *)malloc(sizeof(load_frame_t) * loader->stack_size);
+    loader->key = (char *)malloc(loader->key_size);
+    loader->next_key = (char *)malloc(loader->next_key_size);
+    if (!loader->stack || !loader->key || !loader->next_key) {
+        free(loader->stack);
+        free(loader->key);
+        free(loader->next_key);
+        free(loader);
+        return NULL;
+    }
+    
+    /*
+     * The root, which the children are added to when the loader is finished.
+     */
+    loader->stack[0].depth = 0;
+    loader->stack[0].index = 0;
+    loader->stack[0].has_value = FALSE;
+    loader->stack[0].value = 0;
+    loader->stack[0].num_children = 0;
+    loader->depth = 1;
+    
+    return loader;
+}
+
+/**
+ * @brief Add the next key of a load.
+ *
+ * @param[in, out] loader Pointer to the loader.
+ * @param[in] key The key, it need not be NUL terminated. It must not come
+ *            before the previous key in the order of the alphabet of the
+ *            trie. The same key as the previous one replaces its value.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key.
+ *
+ * @return Boolean indicating if we succeeded or not. Nothing is added if the
+ * key has a character that is not permitted or is out of order. Once memory
+ * allocation failed nothing more is added.
+ */
+boolean trie_loader_add (trie_loader_t *loader, const char *key, size_t size_of_key, int value)
+{
+    trie_t *trie;
+    load_frame_t *frame, *stack;
+    unsigned char *next_key, *last_key;
+    unsigned short index;
+    size_t matched, i;
+    char *swap_key;
+    size_t swap_size;
+    
+    trie = loader->trie;
+    if (loader->failed ||
+        !reserve_key(&loader->next_key, &loader->next_key_size, size_of_key)) {
+        return FALSE;
+    }
+    next_key = (unsigned char *)loader->next_key;
+    last_key = (unsigned char *)loader->key;
+    for (i = 0; i < size_of_key; i++) {
+        index = key_to_index(trie, key[i]);
+        if (index == INVALID_INDEX) {
+            return FALSE;
+        }
+        next_key[i] = (unsigned char)index;
+    }
+    for (matched = 0; (matched < size_of_key) && (matched < loader->key_len) &&
+         (next_key[matched] == last_key[matched]); matched++) {
+        ;
+    }
+    if ((matched < loader->key_len) &&
+        ((matched == size_of_key) || (next_key[matched] < last_key[matched]))) {
+        return FALSE;
+    }
+    if (loader->depth == loader->stack_size) {
+        stack = (load_frame_t *)realloc(loader->stack,
+                                        sizeof(load_frame_t) * loader->stack_size * 2);
+        if (!stack) {
+            return FALSE;
+        }
+        loader->stack = stack;
+        loader->stack_size *= 2;
+    }
+    
+    if (!close_load_frames(loader, matched)) {
+        loader->failed = TRUE;
+        return FALSE;
+    }
+    if (matched == size_of_key) {
+        frame = &loader->stack[loader->depth - 1];
+        frame->has_value = TRUE;
+        frame->value = value;
+    } else {
+        frame = &loader->stack[loader->depth++];
+        frame->depth = size_of_key;
+        frame->index = next_key[matched];
+        frame->has_value = TRUE;
+        frame->value = value;
+        frame->num_children = 0;
+    }
+    
+    swap_key = loader->key;
+    swap_size = loader->key_size;
+    loader->key = loader->next_key;
+    loader->key_size = loader->next_key_size;
+    loader->next_key = swap_key;
+    loader->next_key_size = swap_size;
+    loader->key_len = size_of_key;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Finish a load and free the loader.
+ *
+ * @details
+ * The nodes still open are made and the children of the root are added to
+ * the trie. A persistent trie gets a new root, so snapshots of the empty trie
+ * stay empty.
+ *
+ * @param[in] loader Pointer to the loader.
+ *
+ * @return Boolean indicating if we succeeded or not. The trie is left empty
+ * on failure.
+ */
+boolean trie_loader_finish (trie_loader_t *loader)
+{
+    trie_t *trie;
+    load_frame_t *frame;
+    node_t *root;
+    boolean result;
+    unsigned int i;
+    
+    trie = loader->trie;
+    result = !loader->failed && close_load_frames(loader, 0);
+    root = NULL;
+    if (result) {
+        root = trie->persistent ? alloc_node(trie, NODE_FULL, 0) : trie->child;
+        result = root ? TRUE : FALSE;
+    }
+    if (result) {
+        frame = &loader->stack[0];
+        for (i = 0; i < frame->num_children; i++) {
+            add_child(trie, &root, frame->key[i], frame->child[i]);
+        }
+        frame->num_children = 0;
+        root->has_value = frame->has_value;
+        root->value = frame->value;
+        refresh_max_value(trie, root);
+        if (trie->persistent) {
+            root = __atomic_exchange_n(&trie->child, root, __ATOMIC_ACQ_REL);
+            release_node(trie, root);
+        }
+    }
+    
+    while (loader->depth > 0) {
+        frame = &loader->stack[--loader->depth];
+        for (i = 0; i < frame->num_children; i++) {
+            free_children(trie, frame->child[i]);
+            free_node(trie, frame->child[i]);
+        }
+    }
+    free(loader->stack);
+    free(loader->key);
+    free(loader->next_key);
+    free(loader);
+    
+    return result;
+}
+
+/**
+ * @brief Add a list of keys in any order to an empty trie using many threads.
+ *
+ * @details
+ * The keys are split up by their first character into as many parts as there
+ * are threads, with about the same number of keys in each. Each part is added
+ * to a trie of its own by a thread of its own, so the threads share neither
+ * nodes nor an allocator. The children of the roots of those tries are then
+ * moved under the root of the trie, as no two parts have a first character in
+ * common. The trie must not be used until the build is done.
+ *
+ * @param[in, out] trie Pointer to the trie. It must be empty and not persistent.
+ * @param[in] keys The keys, they need not be NUL terminated. A key that comes up
+ *            more than once gets the last of its values.
+ * @param[in] sizes Number of characters in each key.
+ * @param[in] values Value of each key.
+ * @param[in] num_keys Number of keys.
+ * @param[in] num_threads Number of threads adding keys, including the caller,
+ *            or 0 for as many as there are processors online.
+ *
+ * @return Boolean indicating if we succeeded or not. Nothing is added if memory
+ * allocation failed, a key has a character that is not permitted or the trie
+ * is not empty or persistent.
+ */
+boolean build_trie_parallel (trie_t *trie, const char **keys, const size_t *sizes,
+                             const int *values, size_t num_keys, unsigned int num_threads)
+{
+    trie_part_t *parts;
+    size_t *order;
+    size_t counts[MAX_NUM_CHILD], starts[MAX_NUM_CHILD];
+    char alphabet[MAX_NUM_CHILD + 1];
+    size_t num_parts, num_indexed, target, i;
+    unsigned short index;
+    boolean has_value, result;
+    int value;
+    long num_cpus;
+    
+    if (trie->persistent || node_has_children(trie->child) || trie->child->has_value) {
+        return FALSE;
+    }
+    if (!num_threads) {
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_cpus > 0) ? (unsigned int)num_cpus : 1;
+    }
+    parts = (trie_part_t *)calloc(num_threads, sizeof(trie_part_t));
+    order = (size_t *)malloc(sizeof(size_t) * (num_keys ? num_keys : 1));
+    if (!parts || !order) {
+        free(parts);
+        free(order);
+        return FALSE;
+    }
+    
+    /*
+     * Count the keys by their first key index to find where each index starts
+     * in the order. The empty key goes on the root right away.
+     */
+    memset(counts, 0, sizeof(counts));
+    has_value = FALSE;
+    value = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (!sizes[i]) {
+            has_value = TRUE;
+            value = values[i];
+            continue;
+        }
+        index = key_to_index(trie, keys[i][0]);
+        if (index == INVALID_INDEX) {
+            goto error_handling;
+        }
+        counts[index]++;
+    }
+    for (num_indexed = 0, index = 0; index < MAX_NUM_CHILD; index++) {
+        starts[index] = num_indexed;
+        num_indexed += counts[index];
+    }
+    
+    /*
+     * A part takes the keys of the next key indices until it has its share.
+     */
+    target = (num_indexed + num_threads - 1) / num_threads;
+    num_parts = 0;
+    for (index = 0; index < MAX_NUM_CHILD; index++) {
+        if (!counts[index]) {
+            continue;
+        }
+        if (!num_parts || (parts[num_parts - 1].end - parts[num_parts - 1].start >= target)) {
+            parts[num_parts].start = starts[index];
+            parts[num_parts].end = starts[index];
+            num_parts++;
+        }
+        parts[num_parts - 1].end += counts[index];
+    }
+    for (i = 0; i < num_keys; i++) {
+        if (sizes[i]) {
+            order[starts[key_to_index(trie, keys[i][0])]++] = i;
+        }
+    }
+    
+    /*
+     * Each part gets a trie with the same alphabet and an arena of its own if
+     * the trie has one.
+     */
+    for (i = 0; i < trie->alphabet_size; i++) {
+        alphabet[i] = (char)trie->index_to_char[i];
+    }
+    alphabet[i] = '\0';
+    for (i = 0; i < num_parts; i++) {
+        parts[i].trie = new_trie((trie->alphabet_size == MAX_NUM_CHILD) ? NULL : alphabet,
+                                 trie->arena ? trie->arena->slab_size : 0);
+        if (!parts[i].trie) {
+            goto error_handling;
+        }
+        parts[i].keys = keys;
+        parts[i].sizes = sizes;
+        parts[i].values = values;
+        parts[i].order = order;
+    }
+    
+    /*
+     * The caller builds the first part. A part whose thread can't be started is
+     * built by the caller as well.
+     */
+    for (i = 1; i < num_parts; i++) {
+        parts[i].started = pthread_create(&parts[i].thread, NULL, build_trie_part,
+                                          &parts[i]) ? FALSE : TRUE;
+    }
+    result = TRUE;
+    for (i = 0; i < num_parts; i++) {
+        if (parts[i].started) {
+            pthread_join(parts[i].thread, NULL);
+        } else {
+            build_trie_part(&parts[i]);
+        }
+        result = result && parts[i].result;
+    }
+    if (!result) {
+        goto error_handling;
+    }
+    
+    for (i = 0; i < num_parts; i++) {
+        adopt_trie(trie, parts[i].trie);
+    }
+    trie->child->has_value = has_value;
+    trie->child->value = value;
+    refresh_max_value(trie, trie->child);
+    free(parts);
+    free(order);
+    
+    return TRUE;
+    
+error_handling:
+    for (i = 0; i < num_threads; i++) {
+        if (parts[i].trie) {
+            destroy_trie(parts[i].trie);
+        }
+    }
+    free(parts);
+    free(order);
+    return FALSE;
+}
+
+/**
+ * @brief Make an Aho-Corasick automaton out of the keys of a trie.
+ *
+ * @details
+ * There is a state for each node of the trie and for each character of the
+ * prefixes of the nodes, so a key is spelled out by the states on the way to
+ * it one character at a time. The fail link of a state goes to the state of
+ * the longest proper suffix of its key that is also in the automaton, and its
+ * output link to the first state with a value down the chain of fail links.
+ * Fail links are found going breadth first, as the fail link of a state only
+ * depends on the states closer to the root. The trie must not be changed
+ * while the automaton is made and is left as it is. The empty key is never
+ * found.
+ *
+ * @param[in] trie Pointer to trie.
+ *
+ * @return Pointer to the automaton or NULL if memory allocation failed or
+ * the trie is too big to be addressed with 32 bit indices.
+ */
+aho_corasick_t *build_aho_corasick (trie_t *trie)
+{
+    aho_corasick_t *ac;
+    ac_state_t *state;
+    node_t **order, **nodes, **child_ref;
+    node_t *node;
+    uint32_t *offsets;
+    size_t num_nodes, num_states, i;
+    uint32_t next_state, child, fail;
+    unsigned char index;
+    
+    ac = NULL;
+    nodes = NULL;
+    offsets = NULL;
+    order = breadth_first_order(trie, &num_nodes);
+    if (!order) {
+        return NULL;
+    }
+    num_states = num_nodes;
+    for (i = 0; i < num_nodes; i++) {
+        num_states += order[i]->prefix_len;
+    }
+    free(order);
+    if (num_states > UINT32_MAX) {
+        return NULL;
+    }
+    
+    ac = (aho_corasick_t *)malloc(sizeof(aho_corasick_t));
+    if (!ac) {
+        return NULL;
+    }
+    ac->states = (ac_state_t *)malloc(sizeof(ac_state_t) * num_states);
+    ac->labels = (unsigned char *)malloc(num_states);
+    nodes = (node_t **)malloc(sizeof(node_t *) * num_states);
+    offsets = (uint32_t *)malloc(sizeof(uint32_t) * num_states);
+    if (!ac->states || !ac->labels || !nodes || !offsets) {
+        goto error_handling;
+    }
+    memcpy(ac->char_to_index, trie->char_to_index, sizeof(ac->char_to_index));
+    
+    /*
+     * A state is a node and how much of its prefix has been spelled out.
+     * The states are their own queue.
+     */
+    nodes[0] = trie->child;
+    offsets[0] = 0;
+    ac->labels[0] = 0;
+    ac->states[0].depth = 0;
+    next_state = 1;
+    for (i = 0; i < num_states; i++) {
+        node = nodes[i];
+        state = &ac->states[i];
+        state->first_child = next_state;
+        state->num_children = 0;
+        state->has_value = (i && (offsets[i] == node->prefix_len) && node->has_value) ? 1 : 0;
+        state->value = node->value;
+        if (offsets[i] < node->prefix_len) {
+            ac->labels[next_state] = node_prefix(trie, node)[offsets[i]];
+            nodes[next_state] = node;
+            offsets[next_state] = offsets[i] + 1;
+            ac->states[next_state++].depth = state->depth + 1;
+            state->num_children = 1;
+            continue;
+        }
+        for (child_ref = next_child(trie, node, 0, &index); child_ref;
+             child_ref = next_child(trie, node, index + 1, &index)) {
+            ac->labels[next_state] = index;
+            nodes[next_state] = *child_ref;
+            offsets[next_state] = 0;
+            ac->states[next_state++].depth = state->depth + 1;
+            state->num_children++;
+        }
+    }
+    
+    ac->states[0].fail = 0;
+    ac->states[0].output = 0;
+    for (i = 0; i < num_states; i++) {
+        state = &ac->states[i];
+        for (child = state->first_child; child < state->first_child + state->num_children;
+             child++) {
+            /*
+             * The fail link of a child is the child for the same key index of
+             * the closest state down the chain of fail links that has one.
+             */
+            fail = 0;
+            if (i) {
+                for (fail = state->fail;
+                     !find_ac_child(ac, fail, ac->labels[child], &fail) && fail;
+                     fail = ac->states[fail].fail) {
+                    ;
+                }
+            }
+            ac->states[child].fail = fail;
+            ac->states[child].output = ac->states[fail].has_value ? fail :
+                                                                    ac->states[fail].output;
+        }
+    }
+    free(nodes);
+    free(offsets);
+    
+    return ac;
+    
+error_handling:
+    free(nodes);
+    free(offsets);
+    destroy_aho_corasick(ac);
+    return NULL;
+}
+
+/**
+ * @brief Free an Aho-Corasick automaton.
+ *
+ * @param[in] ac Pointer to the automaton.
+ */
+void destroy_aho_corasick (aho_corasick_t *ac)
+{
+    free(ac->states);
+    free(ac->labels);
+    free(ac);
+}
+
+/**
+ * @brief Start a scan of a text for the keys of an Aho-Corasick automaton.
+ *
+ * @details
+ * The text is fed to the scan a chunk at a time with aho_corasick_scan_feed(),
+ * keys that straddle chunks are found all the same.
+ *
+ * @param[in] ac Pointer to the automaton. It must not be freed while the scan
+ *            is in use.
+ *
+ * @return Pointer to the scan or NULL if memory allocation failed.
+ */
+aho_corasick_scan_t *aho_corasick_scan_create (aho_corasick_t *ac)
+{
+    aho_corasick_scan_t *scan;
+    
+    scan = (aho_corasick_scan_t *)calloc(1, sizeof(aho_corasick_scan_t));
+    if (!scan) {
+        return NULL;
+    }
+    scan->ac = ac;
+    
+    return scan;
+}
+
+/**
+ * @brief Feed the next chunk of the text to a scan.
+ *
+ * @details
+ * Any keys not yet taken out of the previous chunk with
+ * aho_corasick_scan_next() are skipped, as well as the rest of that chunk.
+ *
+ * @param[in, out] scan Pointer to the scan.
+ * @param[in] chunk The chunk, it need not be NUL terminated. It must stay as it
+ *            is until aho_corasick_scan_next() returns FALSE.
+ * @param[in] chunk_size Number of characters in the chunk.
+ */
+void aho_corasick_scan_feed (aho_corasick_scan_t *scan, const char *chunk, size_t chunk_size)
+{
+    scan->offset += scan->chunk_size;
+    scan->chunk = chunk;
+    scan->chunk_size = chunk_size;
+    scan->pos = 0;
+    scan->match = 0;
+}
+
+/**
+ * @brief Find the next key in the text fed to a scan.
+ *
+ * @details
+ * Keys are found in the order of where they end in the text, those ending at
+ * the same place the longest first. A key is found everywhere it occurs, also
+ * inside other keys. Each character only takes the scan from its state down
+ * the chain of fail links until there is a child for it, so a chunk is
+ * scanned in time linear in its size plus the number of keys found.
+ *
+ * @param[in, out] scan Pointer to the scan.
+ * @param[out] end Position in the text, counted from the start of the first
+ *             chunk, right after the key.
+ * @param[out] key_len Length of the key, it starts at end - key_len.
+ * @param[out] value Value stored for the key.
+ *
+ * @return Boolean indicating if a key was found or not. Once it is FALSE the
+ * next chunk can be fed.
+ */
+boolean aho_corasick_scan_next (aho_corasick_scan_t *scan, size_t *end, size_t *key_len,
+                                int *value)
+{
+    aho_corasick_t *ac;
+    uint32_t state;
+    unsigned short index;
+    
+    ac = scan->ac;
+    while (!scan->match) {
+        if (scan->pos == scan->chunk_size) {
+            return FALSE;
+        }
+        index = ac->char_to_index[(unsigned char)scan->chunk[scan->pos++]];
+        if (index == INVALID_INDEX) {
+            scan->state = 0;
+            continue;
+        }
+        for (state = scan->state; !find_ac_child(ac, state, (unsigned char)index, &scan->state);
+             state = ac->states[state].fail) {
+            if (!state) {
+                scan->state = 0;
+                break;
+            }
+        }
+        scan->match = ac->states[scan->state].has_value ? scan->state :
+                                                          ac->states[scan->state].output;
+    }
+    
+    *end = scan->offset + scan->pos;
+    *key_len = ac->states[scan->match].depth;
+    *value = ac->states[scan->match].value;
+    scan->match = ac->states[scan->match].output;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Free a scan.
+ *
+ * @param[in] scan Pointer to the scan.
+ */
+void aho_corasick_scan_destroy (aho_corasick_scan_t *scan)
+{
+    free(scan);
+}
+
+/**
+ * @brief Start going through the keys within an edit distance of a query.
+ *
+ * @details
+ * The edit distance is the number of characters to insert, delete or
+ * substitute to turn a key into the query. The trie is walked depth first
+ * keeping a row of distances for each character of the key of the current
+ * node, and the walk doesn't go below a node once no key there can be close
+ * enough to the query. Keys come out in the order of the alphabet of the trie.
+ * The trie must not be changed while the cursor is in use.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] query The query, it need not be NUL terminated. It may have
+ *            characters that aren't permitted in a key.
+ * @param[in] size_of_query Number of characters in the query.
+ * @param[in] max_distance Largest distance of a key from the query.
+ *
+ * @return Pointer to the cursor or NULL if memory allocation failed.
+ */
+trie_fuzzy_t *trie_fuzzy_search (trie_t *trie, const char *query, size_t size_of_query,
+                                 unsigned int max_distance)
+{
+    trie_fuzzy_t *fuzzy;
+    size_t i;
+    
+    fuzzy = (trie_fuzzy_t *)calloc(1, sizeof(trie_fuzzy_t));
+    if (!fuzzy) {
+        return NULL;
+    }
+    fuzzy->trie = trie;
+    fuzzy->query_len = size_of_query;
+    fuzzy->max_distance = max_distance;
+    fuzzy->stack_size = ITER_STACK_SIZE;
+    fuzzy->key_size = ITER_KEY_SIZE;
+    fuzzy->num_rows = ITER_KEY_SIZE;
+    fuzzy->stack = (iter_frame_t *)malloc(sizeof(iter_frame_t) * fuzzy->stack_size);
+    fuzzy->key = (char *)malloc(fuzzy->key_size);
+    fuzzy->query = (unsigned short *)malloc(sizeof(unsigned short) * (size_of_query + 1));
+    fuzzy->rows = (unsigned int *)malloc(sizeof(unsigned int) * fuzzy->num_rows *
+                                         (size_of_query + 1));
+    if (!fuzzy->stack || !fuzzy->key || !fuzzy->query || !fuzzy->rows) {
+        trie_fuzzy_destroy(fuzzy);
+        return NULL;
+    }
+    for (i = 0; i < size_of_query; i++) {
+        fuzzy->query[i] = key_to_index(trie, query[i]);
+    }
+    
+    /*
+     * The empty key is as far from the query as the query is long.
+     */
+    for (i = 0; i <= size_of_query; i++) {
+        fuzzy->rows[i] = (unsigned int)i;
+    }
+    fuzzy_push(fuzzy, trie->child, 0);
+    
+    return fuzzy;
+}
+
+/**
+ * @brief Move on to the next key of a fuzzy search.
+ *
+ * @details
+ * As trie_iter_next().
+ *
+ * @param[in, out] fuzzy Pointer to the cursor.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer.
+ * @param[out] key_len Length of the whole key, which is more than key_size if
+ *             the key didn't fit.
+ * @param[out] value Value stored for the key.
+ * @param[out] distance Edit distance between the key and the query.
+ *
+ * @return TRUE if there was another key or FALSE if the search is over or
+ * memory allocation failed.
+ */
+boolean trie_fuzzy_next (trie_fuzzy_t *fuzzy, char *key, size_t key_size, size_t *key_len,
+                         int *value, unsigned int *distance)
+{
+    iter_frame_t *frame;
+    node_t *node;
+    node_t **child_ref;
+    unsigned char index;
+    size_t len, child_len;
+    unsigned int node_distance;
+    
+    while (fuzzy->depth > 0) {
+        frame = &fuzzy->stack[fuzzy->depth - 1];
+        node = frame->node;
+        len = frame->key_len;
+        if (frame->next < 0) {
+            frame->next = 0;
+            node_distance = fuzzy->rows[len * (fuzzy->query_len + 1) + fuzzy->query_len];
+            if (node->has_value && (node_distance <= fuzzy->max_distance)) {
+                memcpy(key, fuzzy->key, (len < key_size) ? len : key_size);
+                if (len < key_size) {
+                    key[len] = '\0';
+                }
+                *key_len = len;
+                *value = node->value;
+                *distance = node_distance;
+                
+                return TRUE;
+            }
+        }
+        child_ref = next_child(fuzzy->trie, node, frame->next, &index);
+        if (!child_ref) {
+            fuzzy->depth--;
+            continue;
+        }
+        frame->next = index + 1;
+        child_len = len + 1 + (*child_ref)->prefix_len;
+        if (!reserve_key(&fuzzy->key, &fuzzy->key_size, child_len) ||
+            !reserve_fuzzy_rows(fuzzy, child_len)) {
+            return FALSE;
+        }
+        if (fuzzy_rows(fuzzy, *child_ref, index, len) &&
+            !fuzzy_push(fuzzy, *child_ref, child_len)) {
+            return FALSE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free a cursor of a fuzzy search.
+ *
+ * @param[in] fuzzy Pointer to the cursor.
+ */
+void trie_fuzzy_destroy (trie_fuzzy_t *fuzzy)
+{
+    free(fuzzy->stack);
+    free(fuzzy->key);
+    free(fuzzy->query);
+    free(fuzzy->rows);
+    free(fuzzy);
+}
+
+/**
+ * @brief Start going through the keys that match a pattern.
+ *
+ * @details
+ * In the pattern '?' matches any one character, '*' any number of characters,
+ * none included, and "[...]" any one character of a class such as "[abc]" or
+ * "[a-f]", or any one character not in it if the class starts with '^' or '!'.
+ * A ']' right at the start of a class is one of its characters. '\' makes the
+ * character after it match just itself, any other character matches just
+ * itself too.
+ * The trie is walked depth first keeping the set of positions in the pattern
+ * the key of the current node can be at. The walk only goes into the children
+ * whose characters the pattern may go on with and doesn't go below a node once
+ * the set is empty. Keys come out in the order of the alphabet of the trie.
+ * The trie must not be changed while the cursor is in use.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] pattern The pattern, it need not be NUL terminated.
+ * @param[in] size_of_pattern Number of characters in the pattern.
+ *
+ * @return Pointer to the cursor or NULL if memory allocation failed or the
+ * pattern has a class without a ']' or ends with a '\'.
+ */
+trie_pattern_t *trie_pattern_search (trie_t *trie, const char *pattern, size_t size_of_pattern)
+{
+    trie_pattern_t *search;
+    
+    search = (trie_pattern_t *)calloc(1, sizeof(trie_pattern_t));
+    if (!search) {
+        return NULL;
+    }
+    search->trie = trie;
+    search->stack_size = ITER_STACK_SIZE;
+    search->key_size = ITER_KEY_SIZE;
+    search->num_rows = ITER_KEY_SIZE;
+    search->stack = (pattern_frame_t *)malloc(sizeof(pattern_frame_t) * search->stack_size);
+    search->key = (char *)malloc(search->key_size);
+    search->elements = (pattern_element_t *)malloc(sizeof(pattern_element_t) *
+                                                   (size_of_pattern + 1));
+    if (!search->stack || !search->key || !search->elements ||
+        !compile_pattern(trie, pattern, size_of_pattern, search->elements,
+                         &search->num_elements)) {
+        goto error_handling;
+    }
+    search->row_words = search->num_elements / 64 + 1;
+    search->rows = (uint64_t *)calloc(search->num_rows * search->row_words, sizeof(uint64_t));
+    if (!search->rows) {
+        goto error_handling;
+    }
+    
+    /*
+     * The empty key is at the start of the pattern and past any elements of
+     * any length there.
+     */
+    search->rows[0] = 1;
+    close_pattern_row(search, search->rows);
+    pattern_push(search, trie->child, 0);
+    
+    return search;
+    
+error_handling:
+    trie_pattern_destroy(search);
+    return NULL;
+}
+
+/**
+ * @brief Move on to the next key of a pattern search.
+ *
+ * @details
+ * As trie_iter_next().
+ *
+ * @param[in, out] search Pointer to the cursor.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer.
+ * @param[out] key_len Length of the whole key, which is more than key_size if
+ *             the key didn't fit.
+ * @param[out] value Value stored for the key.
+ *
+ * @return TRUE if there was another key or FALSE if the search is over or
+ * memory allocation failed.
+ */
+boolean trie_pattern_next (trie_pattern_t *search, char *key, size_t key_size, size_t *key_len,
+                           int *value)
+{
+    pattern_frame_t *frame;
+    node_t *node;
+    node_t **child_ref;
+    uint64_t *row;
+    unsigned char index;
+    size_t len, child_len, end;
+    
+    end = search->num_elements;
+    while (search->depth > 0) {
+        frame = &search->stack[search->depth - 1];
+        node = frame->node;
+        len = frame->key_len;
+        if (frame->next < 0) {
+            frame->next = 0;
+            row = search->rows + len * search->row_words;
+            if (node->has_value && (row[end / 64] & ((uint64_t)1 << (end % 64)))) {
+                memcpy(key, search->key, (len < key_size) ? len : key_size);
+                if (len < key_size) {
+                    key[len] = '\0';
+                }
+                *key_len = len;
+                *value = node->value;
+                
+                return TRUE;
+            }
+        }
+        
+        /*
+         * Skip to the next child the pattern may go on with, from both sides.
+         */
+        child_ref = NULL;
+        frame->next = next_mask_index(frame->mask, frame->next);
+        while (frame->next < MAX_NUM_CHILD) {
+            child_ref = next_child(search->trie, node, frame->next, &index);
+            if (!child_ref || (index == frame->next)) {
+                break;
+            }
+            frame->next = next_mask_index(frame->mask, index);
+            child_ref = NULL;
+        }
+        if (!child_ref) {
+            search->depth--;
+            continue;
+        }
+        frame->next = index + 1;
+        child_len = len + 1 + (*child_ref)->prefix_len;
+        if (!reserve_key(&search->key, &search->key_size, child_len) ||
+            !reserve_pattern_rows(search, child_len)) {
+            return FALSE;
+        }
+        if (pattern_rows(search, *child_ref, index, len) &&
+            !pattern_push(search, *child_ref, child_len)) {
+            return FALSE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/**
+ * @brief Free a cursor of a pattern search.
+ *
+ * @param[in] search Pointer to the cursor.
+ */
+void trie_pattern_destroy (trie_pattern_t *search)
+{
+    free(search->stack);
+    free(search->key);
+    free(search->elements);
+    free(search->rows);
+    free(search);
+}
+
+/**
+ * @brief Convert this character to the index of element.
+ * @param[in] trie Pointer to the trie.
+ * @param[in] ch  Character supplied.
+ * @return Index to find the corresponding element in the trie or INVALID_INDEX
+ * if the character isn't permitted in a key.
+ */
+static unsigned short key_to_index (trie_t *trie, char ch)
+{
+    return trie->char_to_index[(unsigned char)ch];
+}
+
+
+/**
+ * @brief Determine if this node has more than one children.
+ *
+ * @param[in] node Reference to the node.
+ * 
+ * @return TRUE if this node has more than one children, FALSE otherwise.
+ */
+static boolean node_has_multiple_children (node_t *node)
+{
+    if (!node) {
+        return FALSE;
+    }
+    
+    return (node->num_children > 1) ? TRUE : FALSE;
+}
+
+/**
+ * @brief Determine if this node has any children.
+ *
+ * @param[in] node Reference to the node.
+ *
+ * @return TRUE if this node has any children, FALSE otherwise.
+ */
+static boolean node_has_children (node_t *node)
+{
+    if (!node) {
+        return FALSE;
+    }
+    
+    return (node->num_children > 0) ? TRUE : FALSE;
+}
+
+/**
+ * @brief Determine if a node has to grow before another child can be added.
+ *
+ * @param[in] node Reference to the node.
+ *
+ * @return TRUE if all the child slots of the node are in use, FALSE otherwise.
+ */
+static boolean node_is_full (node_t *node)
+{
+    switch (node->type) {
+        case NODE_4:
+            return (node->num_children == NODE4_MAX_CHILD) ? TRUE : FALSE;
+        case NODE_16:
+            return (node->num_children == NODE16_MAX_CHILD) ? TRUE : FALSE;
+        case NODE_48:
+            return (node->num_children == NODE48_MAX_CHILD) ? TRUE : FALSE;
+        case NODE_FULL:
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * @brief Size in bytes of a node of a particular type, not counting the prefix.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] type Type of the node.
+ *
+ * @return Number of bytes to allocate for the node.
+ */
+static size_t node_size (trie_t *trie, node_type_t type)
+{
+    switch (type) {
+        case NODE_4:
+            return sizeof(node4_t);
+        case NODE_16:
+            return sizeof(node16_t);
+        case NODE_48:
+            return sizeof(node48_t);
+        case NODE_FULL:
+        default:
+            return sizeof(node_full_t) + sizeof(node_t *) * trie->alphabet_size;
+    }
+}
+
+/**
+ * @brief Type a node grows into once it is out of child slots.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] type Current type of the node.
+ *
+ * @return The next bigger type that can hold fewer children than the alphabet,
+ * or NODE_FULL.
+ */
+static node_type_t grown_node_type (trie_t *trie, node_type_t type)
+{
+    if ((type == NODE_4) && (NODE16_MAX_CHILD < trie->alphabet_size)) {
+        return NODE_16;
+    }
+    if ((type <= NODE_16) && (NODE48_MAX_CHILD < trie->alphabet_size)) {
+        return NODE_48;
+    }
+    
+    return NODE_FULL;
+}
+
+/**
+ * @brief Allocate a node of a particular type without any children or value.
+ *
+ * @param[in] trie Pointer to the trie the node is for.
+ * @param[in] type Type of the node.
+ * @param[in] prefix_len Number of key indices in the prefix of the node. The
+ *            prefix itself is left for the caller to fill in.
+ *
+ * @return Pointer to the node or NULL if memory allocation failed.
+ */
+static node_t *alloc_node (trie_t *trie, node_type_t type, unsigned int prefix_len)
+{
+    node_t *node;
+    
+    if (trie->arena) {
+        node = (node_t *)arena_alloc(trie->arena, node_size(trie, type) + prefix_len);
+    } else if (trie->persistent) {
+        node = (node_t *)malloc(POINTER_ALIGN(node_size(trie, type) + prefix_len) +
+                                sizeof(node_t *));
+    } else {
+        node = (node_t *)malloc(node_size(trie, type) + prefix_len);
+    }
+    if (node) {
+        memset(node, 0, node_size(trie, type));
+        node->type = type;
+        node->max_value = INT_MIN;
+        node->prefix_len = prefix_len;
+        node->version = trie->persistent ? 1 : 0;
+    }
+    
+    return node;
+}
+
+/**
+ * @brief Free a node. The children are not touched.
+ *
+ * @param[in] trie Pointer to the trie the node belongs to.
+ * @param[in] node Pointer to the node.
+ */
+static void free_node (trie_t *trie, node_t *node)
+{
+    if (trie->arena) {
+        arena_free(trie->arena, node, node_size(trie, node->type) + node->prefix_len);
+    } else {
+        free(node);
+    }
+}
+
+/**
+ * @brief Get to the prefix of a node.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ *
+ * @return Pointer to the first of the prefix_len key indices of the prefix.
+ */
+static unsigned char *node_prefix (trie_t *trie, node_t *node)
+{
+    return ((unsigned char *)node + node_size(trie, node->type));
+}
+
+/**
+ * @brief Find the slot holding the child for a key index.
+ *
+ * @param[in] node Pointer to the node.
+ * @param[in] index Key index of the child.
+ *
+ * @return Pointer to the slot holding the child or NULL if there is no such child.
+ */
+static node_t **find_child (node_t *node, unsigned char index)
+{
+    node4_t *node4;
+    node16_t *node16;
+    node48_t *node48;
+    node_full_t *node_full;
+    node_t *child;
+    
+    switch (node->type) {
+        case NODE_4:
+            node4 = (node4_t *)node;
+            for (int i = 0; i < node->num_children; i++) {
+                if (node4->key[i] == index) {
+                    return &node4->child[i];
+                }
+            }
+            break;
+        case NODE_16:
+            node16 = (node16_t *)node;
+            for (int i = 0; (i < node->num_children) && (node16->key[i] <= index); i++) {
+                if (node16->key[i] == index) {
+                    return &node16->child[i];
+                }
+            }
+            break;
+        case NODE_48:
+            node48 = (node48_t *)node;
+            if (node48->child_index[index]) {
+                return &node48->child[node48->child_index[index] - 1];
+            }
+            break;
+        case NODE_FULL:
+            /*
+             * Children of full nodes of a concurrent trie may show up at any
+             * time, see concurrent_add().
+             */
+            node_full = (node_full_t *)node;
+            child = __atomic_load_n(&node_full->child[index], __ATOMIC_ACQUIRE);
+            if (child && (child != SEALED_CHILD)) {
+                return &node_full->child[index];
+            }
+            break;
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Match a node against the key and move on to the next one.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node The node being looked at, updated to the child the key
+ *                 continues with if there is one.
+ * @param[in] key  The key being looked up.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in, out] matched Number of characters of the key matched before the
+ *                 node, updated to include the node and, if there is a child to
+ *                 go on with, the edge to the child.
+ *
+ * @return LOOKUP_NEXT if the lookup goes on with the child, LOOKUP_DONE if the
+ * node is the one for the key, LOOKUP_END if the node matches but the trie
+ * doesn't go on with the rest of the key and LOOKUP_MISS if the node doesn't
+ * match.
+ */
+static lookup_step_t lookup_step (trie_t *trie, node_t **node, const char *key,
+                                  size_t size_of_key, size_t *matched)
+{
+    node_t **child_ref;
+    unsigned char *prefix;
+    unsigned short index;
+    unsigned int j;
+    size_t i;
+    
+    i = *matched;
+    if ((*node)->prefix_len > size_of_key - i) {
+        return LOOKUP_MISS;
+    }
+    prefix = node_prefix(trie, *node);
+    for (j = 0; j < (*node)->prefix_len; j++) {
+        if (prefix[j] != key_to_index(trie, key[i + j])) {
+            return LOOKUP_MISS;
+        }
+    }
+    i += (*node)->prefix_len;
+    *matched = i;
+    if (i == size_of_key) {
+        return LOOKUP_DONE;
+    }
+    index = key_to_index(trie, key[i]);
+    if (index == INVALID_INDEX) {
+        return LOOKUP_END;
+    }
+    child_ref = find_child(*node, index);
+    if (!child_ref) {
+        return LOOKUP_END;
+    }
+    *node = *child_ref;
+    *matched = i + 1;
+    
+    return LOOKUP_NEXT;
+}
+
+/**
+ * @brief Lookup a batch of keys, either exactly or by longest prefix.
+ *
+ * @details
+ * Rather than one key after the other, a group of lookups is kept in flight
+ * and they take turns looking at one node each. Every node a lookup moves on
+ * to is prefetched and by the time its turn comes around again the node is
+ * likely to be in the cache, so the cache misses of the lookups in the group
+ * overlap instead of being paid one after the other. A lookup that is over
+ * makes room for the next key of the batch.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] keys The keys supplied to us, they need not be NUL terminated.
+ * @param[in] sizes sizes[i] is the number of characters in keys[i].
+ * @param[in] num_keys Number of keys in the batch.
+ * @param[out] values values[i] is the value found for keys[i] if found[i] is
+ *             TRUE, otherwise it is left untouched.
+ * @param[out] found found[i] tells whether a value was found for keys[i].
+ * @param[out] match_lens NULL to look for the keys themselves. Otherwise the
+ *             longest key in the trie that is a prefix of keys[i] is looked for
+ *             and match_lens[i] is set to its length.
+ */
+static void batch_lookup (trie_t *trie, const char **keys, const size_t *sizes,
+                          size_t num_keys, int *values, boolean *found, size_t *match_lens)
+{
+    batch_lookup_t group[BATCH_GROUP_SIZE];
+    batch_lookup_t *lookup;
+    lookup_step_t step;
+    node_t *root, *prev;
+    size_t next_key;
+    size_t in_flight, i;
+    size_t k;
+    epoch_slot_t *slot;
+    unsigned long epoch;
+    
+    /*
+     * The lookups of a concurrent trie may have to start over, so they go one
+     * after the other.
+     */
+    if (trie->concurrent) {
+        for (k = 0; k < num_keys; k++) {
+            slot = epoch_enter(trie, &epoch);
+            found[k] = concurrent_lookup(trie, keys[k], sizes[k], &values[k],
+                                         match_lens ? &match_lens[k] : NULL);
+            epoch_exit(trie, slot, epoch);
+        }
+        
+        return;
+    }
+    
+    /*
+     * The whole batch looks at the same version of a persistent trie.
+     */
+    slot = NULL;
+    if (trie->persistent) {
+        slot = epoch_enter(trie, &epoch);
+    }
+    root = __atomic_load_n(&trie->child, __ATOMIC_ACQUIRE);
+    for (in_flight = 0; (in_flight < BATCH_GROUP_SIZE) && (in_flight < num_keys); in_flight++) {
+        group[in_flight].node = root;
+        group[in_flight].key = in_flight;
+        group[in_flight].matched = 0;
+        found[in_flight] = FALSE;
+    }
+    next_key = in_flight;
+    while (in_flight) {
+        for (i = 0; i < in_flight; ) {
+            lookup = &group[i];
+            prev = lookup->node;
+            step = lookup_step(trie, &lookup->node, keys[lookup->key], sizes[lookup->key],
+                               &lookup->matched);
+            if (match_lens && (step != LOOKUP_MISS) && prev->has_value) {
+                values[lookup->key] = prev->value;
+                match_lens[lookup->key] = (step == LOOKUP_NEXT) ? lookup->matched - 1 :
+                                          lookup->matched;
+                found[lookup->key] = TRUE;
+            }
+            if (step == LOOKUP_NEXT) {
+                PREFETCH_NODE(lookup->node);
+                i++;
+                continue;
+            }
+            if (!match_lens && (step == LOOKUP_DONE) && lookup->node->has_value) {
+                values[lookup->key] = lookup->node->value;
+                found[lookup->key] = TRUE;
+            }
+            if (next_key < num_keys) {
+                lookup->node = root;
+                lookup->key = next_key;
+                lookup->matched = 0;
+                found[next_key++] = FALSE;
+                i++;
+            } else {
+                /*
+                 * Nothing left to start, close the gap with the last lookup in flight.
+                 */
+                *lookup = group[--in_flight];
+            }
+        }
+    }
+    if (slot) {
+        epoch_exit(trie, slot, epoch);
+    }
+}
+
+/**
+ * @brief Start looking at a node of a concurrent trie.
+ *
+ * @details
+ * The version of a node has the VERSION_LOCKED bit set while a writer changes
+ * the node and is bumped when the writer is done. VERSION_OBSOLETE is set once
+ * the node has been replaced. Whatever is read from a node is only good if the
+ * version is still the same afterwards, see check_version().
+ *
+ * @param[in] node Pointer to the node.
+ * @param[out] version Version of the node.
+ *
+ * @return FALSE if the node is being changed or has been replaced, in which
+ * case the caller has to start over.
+ */
+static boolean read_lock (node_t *node, unsigned int *version)
+{
+    *version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+    
+    return (*version & (VERSION_LOCKED | VERSION_OBSOLETE)) ? FALSE : TRUE;
+}
+
+/**
+ * @brief Check that a node didn't change while it was being looked at.
+ *
+ * @param[in] node Pointer to the node.
+ * @param[in] version Version of the node from read_lock().
+ *
+ * @return FALSE if the node changed, in which case the caller has to start over.
+ */
+static boolean check_version (node_t *node, unsigned int version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    
+    return (__atomic_load_n(&node->version, __ATOMIC_RELAXED) == version) ? TRUE : FALSE;
+}
+
+/**
+ * @brief Lock a node that has been looked at to change it.
+ *
+ * @param[in] node Pointer to the node.
+ * @param[in] version Version of the node from read_lock().
+ *
+ * @return FALSE if the node changed in the meantime, in which case it isn't
+ * locked and the caller has to start over.
+ */
+static boolean upgrade_lock (node_t *node, unsigned int version)
+{
+    return __atomic_compare_exchange_n(&node->version, &version, version + VERSION_LOCKED,
+                                       FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Unlock a node, bumping its version.
+ *
+ * @details
+ * The lock bit carries over into the counter. A node that has been retired
+ * keeps its VERSION_OBSOLETE bit.
+ *
+ * @param[in] node Pointer to the node.
+ */
+static void write_unlock (node_t *node)
+{
+    __atomic_fetch_add(&node->version, VERSION_LOCKED, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get rid of a node that has been replaced.
+ *
+ * @details
+ * Readers of a concurrent trie may still be looking at the node, so it is marked
+ * obsolete and put on the list of retired nodes instead of being freed, see
+ * reclaim_retired(). The node must be locked or not yet visible to other
+ * threads. A node of a persistent trie loses a reference instead, see
+ * release_node().
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ */
+static void retire_node (trie_t *trie, node_t *node)
+{
+    if (trie->persistent) {
+        release_node(trie, node);
+        return;
+    }
+    if (!trie->concurrent) {
+        free_node(trie, node);
+        return;
+    }
+    __atomic_fetch_or(&node->version, VERSION_OBSOLETE, __ATOMIC_RELEASE);
+    push_retired(trie, node);
+}
+
+/**
+ * @brief Put a node that is no longer in the trie on the list of retired nodes.
+ *
+ * @details
+ * Retired nodes are linked through retired_link() and remember the epoch they
+ * were retired in, see retired_epoch(). The last node is linked to SEALED_CHILD
+ * rather than NULL, so that a child can't be added to a retired full node, see
+ * concurrent_add().
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ */
+static void push_retired (trie_t *trie, node_t *node)
+{
+    node_t **link;
+    node_t *next;
+    
+    *retired_epoch(trie, node) = (int)__atomic_load_n(&trie->epoch, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&trie->num_retired, 1, __ATOMIC_RELAXED);
+    link = retired_link(trie, node);
+    next = __atomic_load_n(&trie->retired, __ATOMIC_RELAXED);
+    do {
+        *link = next ? next : SEALED_CHILD;
+    } while (!__atomic_compare_exchange_n(&trie->retired, &next, node, TRUE,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Find where a retired node is linked to the next one.
+ *
+ * @details
+ * Readers of a concurrent trie notice that a node was retired before making
+ * use of anything read from it, so its first child slot is used. Lookups of a
+ * persistent trie don't check, so its nodes have room for a link after the
+ * prefix that is never looked at otherwise.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the retired node.
+ *
+ * @return Pointer to the link.
+ */
+static node_t **retired_link (trie_t *trie, node_t *node)
+{
+    int num_slots;
+    
+    if (trie->persistent) {
+        return (node_t **)((char *)node + POINTER_ALIGN(node_size(trie, node->type) +
+                                                        node->prefix_len));
+    }
+    
+    return child_slots(trie, node, &num_slots);
+}
+
+/**
+ * @brief Find where a retired node keeps the epoch it was retired in.
+ *
+ * @details
+ * The value of a node of a concurrent trie, as writers may still raise the
+ * largest value cached in it. The largest value of a node of a persistent
+ * trie, which lookups don't look at.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the retired node.
+ *
+ * @return Pointer to the epoch.
+ */
+static int *retired_epoch (trie_t *trie, node_t *node)
+{
+    return trie->persistent ? &node->max_value : &node->value;
+}
+
+/**
+ * @brief Free the retired nodes of a trie.
+ *
+ * @details
+ * No other thread may be using the trie.
+ *
+ * @param[in] trie Pointer to the trie.
+ */
+static void free_retired (trie_t *trie)
+{
+    node_t *node, *next;
+    
+    for (node = trie->retired; node && (node != SEALED_CHILD); node = next) {
+        next = *retired_link(trie, node);
+        free_node(trie, node);
+    }
+    trie->retired = NULL;
+}
+
+/**
+ * @brief Enter a critical section of a concurrent trie.
+ *
+ * @details
+ * No node that is retired after a thread entered the critical section is freed
+ * before the thread has left it. The thread is counted in one of the slots of
+ * the trie under the parity of the current epoch. If the epoch moved on while
+ * the thread was being counted, it counts itself again under the new epoch.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[out] epoch The epoch the thread entered in.
+ *
+ * @return The slot the thread is counted in.
+ */
+static epoch_slot_t *epoch_enter (trie_t *trie, unsigned long *epoch)
+{
+    static unsigned int next_slot;
+    static __thread int thread_slot = -1;
+    epoch_slot_t *slot;
+    
+    if (thread_slot < 0) {
+        thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % EPOCH_SLOTS;
+    }
+    slot = &trie->epoch_slots[thread_slot];
+    for (;;) {
+        *epoch = __atomic_load_n(&trie->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&slot->active[*epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&trie->epoch, __ATOMIC_SEQ_CST) == *epoch) {
+            return slot;
+        }
+        __atomic_fetch_sub(&slot->active[*epoch & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Leave a critical section of a concurrent trie.
+ *
+ * @details
+ * Once enough nodes have been retired, the thread goes on to free the ones
+ * that no one can get to any more.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] slot The slot from epoch_enter().
+ * @param[in] epoch The epoch from epoch_enter().
+ */
+static void epoch_exit (trie_t *trie, epoch_slot_t *slot, unsigned long epoch)
+{
+    __atomic_fetch_sub(&slot->active[epoch & 1], 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&trie->num_retired, __ATOMIC_RELAXED) >= RECLAIM_THRESHOLD) {
+        reclaim_retired(trie);
+    }
+}
+
+/**
+ * @brief Free the retired nodes of a concurrent trie that no one can get to.
+ *
+ * @details
+ * The epoch moves on once no thread is left in a critical section entered in
+ * the epoch before the current one, so while a thread is in a critical section
+ * the epoch can get at most one ahead of the epoch it entered in. A node may be
+ * retired just before it is taken out of the trie, so threads that enter up to
+ * one epoch after it was retired may still get to it. Three epochs after it was
+ * retired all of those threads are gone and it is freed.
+ * Only one thread frees nodes at a time, others just carry on.
+ *
+ * @param[in] trie Pointer to the trie.
+ */
+static void reclaim_retired (trie_t *trie)
+{
+    node_t *node, *next, *keep, *keep_tail;
+    node_t **link;
+    unsigned long epoch;
+    int i;
+    
+    if (__atomic_exchange_n(&trie->reclaiming, TRUE, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&trie->num_retired, 0, __ATOMIC_RELAXED);
+    epoch = __atomic_load_n(&trie->epoch, __ATOMIC_SEQ_CST);
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+        if (__atomic_load_n(&trie->epoch_slots[i].active[(epoch - 1) & 1], __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
+    if (i == EPOCH_SLOTS) {
+        __atomic_store_n(&trie->epoch, ++epoch, __ATOMIC_SEQ_CST);
+    }
+    
+    /*
+     * Take the whole list, free what can be freed and put the rest back.
+     */
+    keep = NULL;
+    keep_tail = NULL;
+    for (node = __atomic_exchange_n(&trie->retired, NULL, __ATOMIC_ACQUIRE);
+         node && (node != SEALED_CHILD); node = next) {
+        link = retired_link(trie, node);
+        next = *link;
+        if ((unsigned int)epoch - (unsigned int)*retired_epoch(trie, node) >= 3) {
+            free_node(trie, node);
+            continue;
+        }
+        *link = keep ? keep : SEALED_CHILD;
+        keep = node;
+        if (!keep_tail) {
+            keep_tail = node;
+        }
+    }
+    if (keep) {
+        link = retired_link(trie, keep_tail);
+        next = __atomic_load_n(&trie->retired, __ATOMIC_RELAXED);
+        do {
+            *link = next ? next : SEALED_CHILD;
+        } while (!__atomic_compare_exchange_n(&trie->retired, &next, keep, TRUE,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    __atomic_store_n(&trie->reclaiming, FALSE, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Make sure the largest value cached in a node is at least a value.
+ *
+ * @details
+ * Writers of a concurrent trie raise the cached values of the nodes they go
+ * through without locking them. Cached values are never lowered in a concurrent
+ * trie, so they are only upper bounds, which is all top_k_in_trie() relies on.
+ *
+ * @param[in] node Pointer to the node.
+ * @param[in] value The value.
+ */
+static void raise_max_value (node_t *node, int value)
+{
+    int max_value;
+    
+    max_value = __atomic_load_n(&node->max_value, __ATOMIC_RELAXED);
+    while ((max_value < value) &&
+           !__atomic_compare_exchange_n(&node->max_value, &max_value, value, TRUE,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+/**
+ * @brief Stop children from being added to a full node of a concurrent trie.
+ *
+ * @details
+ * Children are added to full nodes without locking them, see concurrent_add().
+ * A writer that has locked a full node and is about to copy it, take it out of
+ * the trie or count on the number of its children seals it first, filling each
+ * free slot with SEALED_CHILD, so the children it sees are all there is. Seals
+ * that are left on a node that stays in the trie are taken off with
+ * unseal_node() before it is unlocked.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the full node. It must be locked.
+ *
+ * @return Number of children of the node.
+ */
+static int seal_node (trie_t *trie, node_t *node)
+{
+    node_full_t *node_full;
+    node_t *child;
+    int num_children, i;
+    
+    node_full = (node_full_t *)node;
+    num_children = 0;
+    for (i = 0; i < trie->alphabet_size; i++) {
+        child = NULL;
+        if (!__atomic_compare_exchange_n(&node_full->child[i], &child, SEALED_CHILD, FALSE,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+            (child != SEALED_CHILD)) {
+            num_children++;
+        }
+    }
+    
+    return num_children;
+}
+
+/**
+ * @brief Let children be added to a sealed full node again.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the full node. It must be locked.
+ */
+static void unseal_node (trie_t *trie, node_t *node)
+{
+    node_full_t *node_full;
+    int i;
+    
+    node_full = (node_full_t *)node;
+    for (i = 0; i < trie->alphabet_size; i++) {
+        if (node_full->child[i] == SEALED_CHILD) {
+            __atomic_store_n(&node_full->child[i], NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/**
+ * @brief Lookup a key below a root.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] root Pointer to the root.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value The value found.
+ *
+ * @return Boolean indicating whether a value was found.
+ */
+static boolean lookup_from (trie_t *trie, node_t *root, const char *key, size_t size_of_key,
+                            int *value)
+{
+    node_t *node;
+    lookup_step_t step;
+    size_t matched;
+    
+    node = root;
+    matched = 0;
+    do {
+        step = lookup_step(trie, &node, key, size_of_key, &matched);
+    } while (step == LOOKUP_NEXT);
+    if ((step != LOOKUP_DONE) || !node->has_value) {
+        return FALSE;
+    }
+    *value = node->value;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Add a value with a key below a root.
+ *
+ * @details
+ * See add_to_trie_len(). The nodes of a persistent trie are copied on the way
+ * down, so that only nodes private to the new version are changed.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] root_ref Slot pointing to the root.
+ * @param[in] key The key provided to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean add_from_root (trie_t *trie, node_t **root_ref, const char *key,
+                              size_t size_of_key, int value)
+{
+    node_t **node_ref;
+    node_t **child_ref;
+    node_t *node;
+    node_t *child;
+    unsigned char *prefix;
+    unsigned short index;
+    unsigned int matched, depth, d;
+    int old_value;
+    size_t i;
+    
+    /*
+     * The nodes on the way down are remembered so that the largest values cached
+     * in them can be brought up to date once the key has been added. Only the
+     * last node can be replaced on the way, so the rest stay valid.
+     */
+    node_ref = root_ref;
+    depth = 0;
+    i = 0;
+    for (;;) {
+        if (!grow_path(trie, depth)) {
+            return FALSE;
+        }
+        node = *node_ref;
+        if (trie->persistent) {
+            node = resize_node(trie, node, node->type);
+            if (!node) {
+                return FALSE;
+            }
+            *node_ref = node;
+        }
+        trie->path[depth] = node;
+        prefix = node_prefix(trie, node);
+        for (matched = 0; (matched < node->prefix_len) && (i + matched < size_of_key) &&
+             (prefix[matched] == key_to_index(trie, key[i + matched])); matched++) {
+            ;
+        }
+        i += matched;
+        if (i == size_of_key) {
+            if (matched < node->prefix_len) {
+                if (!split_node(trie, node_ref, matched)) {
+                    return FALSE;
+                }
+                node = *node_ref;
+            }
+            break;
+        }
+        index = key_to_index(trie, key[i]);
+        if (index == INVALID_INDEX) {
+            return FALSE;
+        }
+        if (matched < node->prefix_len) {
+            child_ref = NULL;
+        } else {
+            child_ref = find_child(node, index);
+        }
+        if (child_ref == NULL) {
+            child = new_leaf(trie, key + i + 1, size_of_key - i - 1, value);
+            if (!child) {
+                return FALSE;
+            }
+            if ((matched < node->prefix_len) && !split_node(trie, node_ref, matched)) {
+                free_node(trie, child);
+                return FALSE;
+            }
+            if (!add_child(trie, node_ref, index, child)) {
+                free_node(trie, child);
+                return FALSE;
+            }
+            trie->path[depth] = *node_ref;
+            break;
+        }
+        node_ref = child_ref;
+        depth++;
+        i++;
+    }
+    if (i == size_of_key) {
+        trie->path[depth] = node;
+        if (node->has_value && (value < node->value) && (node->value == node->max_value)) {
+            old_value = node->value;
+            node->value = value;
+            lower_max_values(trie, depth, old_value);
+            
+            return TRUE;
+        }
+        node->value = value;
+        node->has_value = TRUE;
+    }
+    for (d = 0; d <= depth; d++) {
+        if (trie->path[d]->max_value < value) {
+            trie->path[d]->max_value = value;
+        }
+    }
+    
+    return TRUE;
+}
+
+/**
+ * @brief Delete the value stored for a key below a root.
+ *
+ * @details
+ * See delete_from_trie_len(). The nodes of a persistent trie are copied on the
+ * way down, so that only nodes private to the new version are changed.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] root_ref Slot pointing to the root.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ *
+ * @return Boolean indicating if we deleted the key, value pair or not.
+ */
+static boolean delete_from_root (trie_t *trie, node_t **root_ref, const char *key,
+                                 size_t size_of_key)
+{
+    node_t *node;
+    node_t **node_ref, **parent_ref;
+    unsigned char *prefix;
+    unsigned short index = 0;
+    unsigned int j, depth;
+    int old_value;
+    boolean was_max;
+    size_t i;
+    
+    /*
+     * Removing a child may cause the parent to be replaced with a node of a different
+     * type, so we hold on to the slots pointing to the node and its parent rather than
+     * to the nodes themselves. Nothing further up can be affected, the nodes up there
+     * are remembered to bring the largest values cached in them up to date.
+     */
+    parent_ref = NULL;
+    node_ref = root_ref;
+    depth = 0;
+    i = 0;
+    for (;;) {
+        if (!grow_path(trie, depth)) {
+            return FALSE;
+        }
+        node = *node_ref;
+        if (trie->persistent) {
+            node = resize_node(trie, node, node->type);
+            if (!node) {
+                return FALSE;
+            }
+            *node_ref = node;
+        }
+        trie->path[depth] = node;
+        if (node->prefix_len > size_of_key - i) {
+            return FALSE;
+        }
+        prefix = node_prefix(trie, node);
+        for (j = 0; j < node->prefix_len; j++) {
+            if (prefix[j] != key_to_index(trie, key[i + j])) {
+                return FALSE;
+            }
+        }
+        i += node->prefix_len;
+        if (i == size_of_key) {
+            break;
+        }
+        index = key_to_index(trie, key[i]);
+        if (index == INVALID_INDEX) {
+            return FALSE;
+        }
+        parent_ref = node_ref;
+        node_ref = find_child(node, index);
+        if (!node_ref) {
+            return FALSE;
+        }
+        depth++;
+        i++;
+    }
+    if (!node->has_value) {
+        return FALSE;
+    }
+    /*
+     * If there's a bigger value below the node, no cached largest value changes.
+     */
+    old_value = node->value;
+    was_max = (old_value == node->max_value);
+    node->has_value = FALSE;
+    node->value = 0;
+    
+    /*
+     * The root stays as it is no matter what.
+     */
+    if (parent_ref) {
+        if (!node_has_children(node)) {
+            /*
+             * index still holds the character leading to this node.
+             */
+            free_node(trie, node);
+            remove_child(trie, parent_ref, index);
+            node = *parent_ref;
+            if ((parent_ref != root_ref) && !node->has_value &&
+                !node_has_multiple_children(node)) {
+                merge_with_child(trie, parent_ref);
+            }
+            depth--;
+            trie->path[depth] = *parent_ref;
+        } else if (!node_has_multiple_children(node)) {
+            merge_with_child(trie, node_ref);
+            trie->path[depth] = *node_ref;
+        }
+    }
+    if (was_max) {
+        lower_max_values(trie, depth, old_value);
+    }
+    
+    return TRUE;
+}
+
+/**
+ * @brief Add a key to or delete a key from a persistent trie.
+ *
+ * @details
+ * The change is made below a draft root that starts out as a reference to the
+ * current root. Every node on the way to the key is copied before it is looked
+ * at, so that nothing reachable from an earlier version is changed. Once the
+ * change is complete the draft becomes the current root and the reference of
+ * the trie to the old one is released. If the change fails the draft is
+ * released instead.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] key The key, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key when adding.
+ * @param[in] add Whether the key is added rather than deleted.
+ *
+ * @return Boolean indicating if the key was added or deleted.
+ */
+static boolean persistent_write (trie_t *trie, const char *key, size_t size_of_key,
+                                 int value, boolean add)
+{
+    epoch_slot_t *slot;
+    unsigned long epoch;
+    node_t *root;
+    boolean done;
+    
+    slot = epoch_enter(trie, &epoch);
+    root = trie->child;
+    __atomic_fetch_add(&root->version, 1, __ATOMIC_RELAXED);
+    trie->draft = root;
+    if (add) {
+        done = add_from_root(trie, &trie->draft, key, size_of_key, value);
+    } else {
+        done = delete_from_root(trie, &trie->draft, key, size_of_key);
+    }
+    if (done) {
+        __atomic_store_n(&trie->child, trie->draft, __ATOMIC_RELEASE);
+        release_node(trie, root);
+    } else {
+        release_node(trie, trie->draft);
+    }
+    trie->draft = NULL;
+    epoch_exit(trie, slot, epoch);
+    
+    return done;
+}
+
+/**
+ * @brief Drop a reference to a node of a persistent trie.
+ *
+ * @details
+ * A node is referenced by each node pointing to it, by the trie if it is the
+ * current root and by each snapshot of which it is the root. The node is
+ * freed along with whatever only it referred to once the last reference is
+ * dropped, see free_unreferenced().
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ */
+static void release_node (trie_t *trie, node_t *node)
+{
+    if (!__atomic_sub_fetch(&node->version, 1, __ATOMIC_ACQ_REL)) {
+        free_unreferenced(trie, node);
+    }
+}
+
+/**
+ * @brief Free a node of a persistent trie that has no references left.
+ *
+ * @details
+ * The children of the node each lose a reference, and so on down for those
+ * that lose their last one. Lookups may still be looking at the nodes, so
+ * they are retired rather than freed, see reclaim_retired(). A stack on the
+ * C stack keeps track of the nodes left to look at, and when it runs out the
+ * rest is handled recursively.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ */
+static void free_unreferenced (trie_t *trie, node_t *node)
+{
+    node_t *stack[RELEASE_STACK_SIZE];
+    node_t **slots;
+    int num_slots, depth, i;
+    
+    stack[0] = node;
+    depth = 1;
+    while (depth) {
+        node = stack[--depth];
+        slots = child_slots(trie, node, &num_slots);
+        for (i = 0; i < num_slots; i++) {
+            if (!slots[i] || __atomic_sub_fetch(&slots[i]->version, 1, __ATOMIC_ACQ_REL)) {
+                continue;
+            }
+            if (depth < RELEASE_STACK_SIZE) {
+                stack[depth++] = slots[i];
+            } else {
+                free_unreferenced(trie, slots[i]);
+            }
+        }
+        push_retired(trie, node);
+    }
+}
+
+/**
+ * @brief Lookup a key in a concurrent trie, either exactly or by longest prefix.
+ *
+ * @details
+ * Each node is matched against the key as usual, and what was read from it is
+ * only used once its version turns out to be unchanged. The version of a node
+ * is checked before moving on to a child it points to, so the child was in the
+ * trie at that point. If anything changed, the lookup starts over.
+ *
+ * @param[in] trie Pointer to trie.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[out] value The value found.
+ * @param[out] match_len NULL to look for the key itself. Otherwise the longest
+ *             key in the trie that is a prefix of the key is looked for and its
+ *             length is returned here.
+ *
+ * @return Boolean indicating whether a value was found.
+ */
+static boolean concurrent_lookup (trie_t *trie, const char *key, size_t size_of_key,
+                                  int *value, size_t *match_len)
+{
+    node_t *node, *next;
+    lookup_step_t step;
+    unsigned int version, next_version;
+    size_t matched, found_len;
+    boolean has_value, found;
+    int node_value, found_value;
+    
+restart:
+    node = trie->child;
+    if (!read_lock(node, &version)) {
+        goto restart;
+    }
+    matched = 0;
+    found = FALSE;
+    for (;;) {
+        next = node;
+        step = lookup_step(trie, &next, key, size_of_key, &matched);
+        has_value = node->has_value;
+        node_value = node->value;
+        if (!check_version(node, version)) {
+            goto restart;
+        }
+        if (has_value && ((step == LOOKUP_DONE) ||
+                          (match_len && (step != LOOKUP_MISS)))) {
+            found = TRUE;
+            found_value = node_value;
+            found_len = (step == LOOKUP_NEXT) ? matched - 1 : matched;
+        }
+        if (step != LOOKUP_NEXT) {
+            break;
+        }
+        if (!read_lock(next, &next_version)) {
+            goto restart;
+        }
+        node = next;
+        version = next_version;
+    }
+    if (found) {
+        *value = found_value;
+        if (match_len) {
+            *match_len = found_len;
+        }
+    }
+    
+    return found;
+}
+
+/**
+ * @brief Add a value with a key to a concurrent trie.
+ *
+ * @details
+ * Go down the trie like a lookup. A new child of a full node, and the rest of
+ * the key below it, is set up privately and then put in its slot with a single
+ * compare and swap, without any locks. If the slot was taken in the meantime
+ * or the node was sealed, the add starts over. Setting the value of an existing
+ * node or adding a child to a smaller node with a free slot only locks that
+ * node. Splitting a
+ * node or growing it into a bigger type replaces it in its parent, so the parent
+ * is locked as well. The root never has to be replaced as it has no prefix and
+ * is a full node. New nodes are set up before taking any lock.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] key The key provided to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ * @param[in] value Value corresponding to the key.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean concurrent_add (trie_t *trie, const char *key, size_t size_of_key, int value)
+{
+    node_t **node_ref, **child_ref;
+    node_t *node, *parent, *next, *leaf;
+    unsigned int version, parent_version, next_version;
+    unsigned char *prefix;
+    unsigned short index;
+    unsigned int matched;
+    boolean lock_parent, done;
+    size_t i;
+    
+    /*
+     * Check the key up front, there's no going back once the trie has changed.
+     */
+    for (i = 0; i < size_of_key; i++) {
+        if (key_to_index(trie, key[i]) == INVALID_INDEX) {
+            return FALSE;
+        }
+    }
+    
+restart:
+    parent = NULL;
+    parent_version = 0;
+    node_ref = &trie->child;
+    node = *node_ref;
+    if (!read_lock(node, &version)) {
+        goto restart;
+    }
+    i = 0;
+    for (;;) {
+        prefix = node_prefix(trie, node);
+        for (matched = 0; (matched < node->prefix_len) && (i + matched < size_of_key) &&
+             (prefix[matched] == key_to_index(trie, key[i + matched])); matched++) {
+            ;
+        }
+        
+        if (matched < node->prefix_len) {
+            assert(parent);
+            leaf = NULL;
+            if (i + matched < size_of_key) {
+                leaf = new_leaf(trie, key + i + matched + 1, size_of_key - i - matched - 1,
+                                value);
+                if (!leaf) {
+                    return FALSE;
+                }
+            }
+            if (!upgrade_lock(parent, parent_version)) {
+                goto retry;
+            }
+            if (!upgrade_lock(node, version)) {
+                write_unlock(parent);
+                goto retry;
+            }
+            done = split_node(trie, node_ref, matched);
+            if (done) {
+                /*
+                 * The parent is still locked, so no one else can get to the new node.
+                 */
+                if (leaf) {
+                    add_child(trie, node_ref, key_to_index(trie, key[i + matched]), leaf);
+                } else {
+                    (*node_ref)->value = value;
+                    (*node_ref)->has_value = TRUE;
+                }
+                raise_max_value(*node_ref, value);
+            } else if (leaf) {
+                free_node(trie, leaf);
+            }
+            write_unlock(node);
+            write_unlock(parent);
+            
+            return done;
+        }
+        i += matched;
+        
+        if (i == size_of_key) {
+            if (!upgrade_lock(node, version)) {
+                goto restart;
+            }
+            node->value = value;
+            node->has_value = TRUE;
+            raise_max_value(node, value);
+            write_unlock(node);
+            
+            return TRUE;
+        }
+        
+        index = key_to_index(trie, key[i]);
+        child_ref = find_child(node, index);
+        if (!child_ref) {
+            leaf = new_leaf(trie, key + i + 1, size_of_key - i - 1, value);
+            if (!leaf) {
+                return FALSE;
+            }
+            if (node->type == NODE_FULL) {
+                /*
+                 * The number of children and the cached value are raised first,
+                 * so that whoever seals the node later on sees them.
+                 */
+                raise_max_value(node, value);
+                __atomic_fetch_add(&node->num_children, 1, __ATOMIC_SEQ_CST);
+                next = NULL;
+                if (!__atomic_compare_exchange_n(&((node_full_t *)node)->child[index], &next,
+                                                 leaf, FALSE, __ATOMIC_SEQ_CST,
+                                                 __ATOMIC_RELAXED)) {
+                    __atomic_fetch_sub(&node->num_children, 1, __ATOMIC_RELAXED);
+                    goto retry;
+                }
+                
+                return TRUE;
+            }
+            lock_parent = node_is_full(node);
+            assert(!lock_parent || parent);
+            if (lock_parent && !upgrade_lock(parent, parent_version)) {
+                goto retry;
+            }
+            if (!upgrade_lock(node, version)) {
+                if (lock_parent) {
+                    write_unlock(parent);
+                }
+                goto retry;
+            }
+            /*
+             * Without the lock on the parent, the slot pointing to the node may
+             * move, but then the node isn't replaced either.
+             */
+            if (!lock_parent) {
+                node_ref = &next;
+                next = node;
+            }
+            done = add_child(trie, node_ref, index, leaf);
+            if (done) {
+                raise_max_value(*node_ref, value);
+            } else {
+                free_node(trie, leaf);
+            }
+            write_unlock(node);
+            if (lock_parent) {
+                write_unlock(parent);
+            }
+            
+            return done;
+        }
+        
+        next = *child_ref;
+        raise_max_value(node, value);
+        if (!check_version(node, version)) {
+            goto restart;
+        }
+        if (!read_lock(next, &next_version)) {
+            goto restart;
+        }
+        parent = node;
+        parent_version = version;
+        node_ref = child_ref;
+        node = next;
+        version = next_version;
+        i++;
+    }
+    
+retry:
+    if (leaf) {
+        free_node(trie, leaf);
+    }
+    goto restart;
+}
+
+/**
+ * @brief Delete the value stored for a key in a concurrent trie.
+ *
+ * @details
+ * Go down the trie like a lookup. Clearing the value of a node that keeps its
+ * place only locks that node. Merging a node with its only child locks the
+ * parent, the node and the child. Removing a node locks its parent, the node
+ * and the grandparent, since the parent may shrink into a smaller type, and
+ * the other child of the parent if the two of them are to be merged.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] key The key supplied to us, it need not be NUL terminated.
+ * @param[in] size_of_key Number of characters in the key.
+ *
+ * @return Boolean indicating if we deleted the key, value pair or not.
+ */
+static boolean concurrent_delete (trie_t *trie, const char *key, size_t size_of_key)
+{
+    node_t **node_ref, **parent_ref, **child_ref;
+    node_t *node, *parent, *grandparent, *next, *other;
+    node_t *locked[4], *sealed[2];
+    unsigned int version, parent_version, grandparent_version, next_version;
+    unsigned char *prefix;
+    unsigned char other_index;
+    unsigned short index = 0;
+    unsigned int j;
+    int num_locked, num_sealed, num_children;
+    boolean merge, done;
+    size_t i;
+    
+restart:
+    num_locked = 0;
+    num_sealed = 0;
+    done = FALSE;
+    grandparent = NULL;
+    parent = NULL;
+    grandparent_version = 0;
+    parent_version = 0;
+    parent_ref = NULL;
+    node_ref = &trie->child;
+    node = *node_ref;
+    if (!read_lock(node, &version)) {
+        goto restart;
+    }
+    i = 0;
+    for (;;) {
+        if (node->prefix_len > size_of_key - i) {
+            goto miss;
+        }
+        prefix = node_prefix(trie, node);
+        for (j = 0; j < node->prefix_len; j++) {
+            if (prefix[j] != key_to_index(trie, key[i + j])) {
+                goto miss;
+            }
+        }
+        i += node->prefix_len;
+        if (i == size_of_key) {
+            break;
+        }
+        index = key_to_index(trie, key[i]);
+        if (index == INVALID_INDEX) {
+            goto miss;
+        }
+        child_ref = find_child(node, index);
+        if (!child_ref) {
+            goto miss;
+        }
+        next = *child_ref;
+        if (!check_version(node, version)) {
+            goto restart;
+        }
+        if (!read_lock(next, &next_version)) {
+            goto restart;
+        }
+        grandparent = parent;
+        grandparent_version = parent_version;
+        parent = node;
+        parent_version = version;
+        parent_ref = node_ref;
+        node_ref = child_ref;
+        node = next;
+        version = next_version;
+        i++;
+    }
+    if (!node->has_value) {
+        goto miss;
+    }
+    
+    /*
+     * Lock from the top down. Locks are only ever tried, never waited for, so
+     * writers can't deadlock. Children may still be added to a locked full
+     * node, so full nodes that are merged or removed are sealed, except for the
+     * root which stays put.
+     */
+    if (!parent || node_has_multiple_children(node)) {
+        if (!upgrade_lock(node, version)) {
+            goto restart;
+        }
+        node->has_value = FALSE;
+        node->value = 0;
+        write_unlock(node);
+        
+        return TRUE;
+    }
+    
+    if (node_has_children(node)) {
+        if (!upgrade_lock(parent, parent_version)) {
+            goto restart;
+        }
+        locked[num_locked++] = parent;
+        if (!upgrade_lock(node, version)) {
+            goto unlock;
+        }
+        locked[num_locked++] = node;
+        num_children = node->num_children;
+        if (node->type == NODE_FULL) {
+            num_children = seal_node(trie, node);
+            sealed[num_sealed++] = node;
+        }
+        if (num_children != 1) {
+            goto unlock;
+        }
+        other = *first_child(trie, node, &other_index);
+        if (!read_lock(other, &next_version) || !upgrade_lock(other, next_version)) {
+            goto unlock;
+        }
+        locked[num_locked++] = other;
+        node->has_value = FALSE;
+        node->value = 0;
+        merge_with_child(trie, node_ref);
+    } else {
+        if (grandparent) {
+            if (!upgrade_lock(grandparent, grandparent_version)) {
+                goto restart;
+            }
+            locked[num_locked++] = grandparent;
+        }
+        if (!upgrade_lock(parent, parent_version)) {
+            goto unlock;
+        }
+        locked[num_locked++] = parent;
+        if (!upgrade_lock(node, version)) {
+            goto unlock;
+        }
+        locked[num_locked++] = node;
+        if (node->type == NODE_FULL) {
+            sealed[num_sealed++] = node;
+            if (seal_node(trie, node)) {
+                goto unlock;
+            }
+        }
+        num_children = parent->num_children;
+        if (grandparent && (parent->type == NODE_FULL)) {
+            num_children = seal_node(trie, parent);
+            sealed[num_sealed++] = parent;
+        }
+        merge = (grandparent && !parent->has_value && (num_children == 2));
+        if (merge) {
+            child_ref = next_child(trie, parent, 0, &other_index);
+            if (other_index == index) {
+                child_ref = next_child(trie, parent, index + 1, &other_index);
+            }
+            other = *child_ref;
+            if (!read_lock(other, &next_version) || !upgrade_lock(other, next_version)) {
+                goto unlock;
+            }
+            locked[num_locked++] = other;
+        }
+        node->has_value = FALSE;
+        node->value = 0;
+        retire_node(trie, node);
+        remove_child(trie, parent_ref, index);
+        if (merge) {
+            merge_with_child(trie, parent_ref);
+        }
+    }
+    done = TRUE;
+    
+unlock:
+    while (num_sealed > 0) {
+        other = sealed[--num_sealed];
+        if (!(other->version & VERSION_OBSOLETE)) {
+            unseal_node(trie, other);
+        }
+    }
+    while (num_locked > 0) {
+        write_unlock(locked[--num_locked]);
+    }
+    if (!done) {
+        goto restart;
+    }
+    
+    return TRUE;
+    
+miss:
+    if (!check_version(node, version)) {
+        goto restart;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Get to the array of child slots of a node.
+ *
+ * @details
+ * For NODE_4 and NODE_16 all the slots are in use, the slots of a NODE_48 or
+ * NODE_FULL may be NULL. The slots are in key order except for a NODE_48.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ * @param[out] num_slots Number of slots to look at.
+ *
+ * @return Pointer to the first slot.
+ */
+static node_t **child_slots (trie_t *trie, node_t *node, int *num_slots)
+{
+    switch (node->type) {
+        case NODE_4:
+            *num_slots = node->num_children;
+            return ((node4_t *)node)->child;
+        case NODE_16:
+            *num_slots = node->num_children;
+            return ((node16_t *)node)->child;
+        case NODE_48:
+            *num_slots = NODE48_MAX_CHILD;
+            return ((node48_t *)node)->child;
+        case NODE_FULL:
+        default:
+            *num_slots = trie->alphabet_size;
+            return ((node_full_t *)node)->child;
+    }
+}
+
+/**
+ * @brief Free all the nodes below a node.
+ *
+ * @details
+ * Walk the subtree depth first with an explicit stack of nodes yet to be
+ * freed. The stack starts off in a local array and only moves to the heap
+ * for very bushy tries. The node itself is left untouched, slots and all.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ */
+static void free_children (trie_t *trie, node_t *node)
+{
+    node_t *local_stack[FREE_STACK_SIZE];
+    node_t **stack, **bigger_stack, **slots;
+    node_t *top;
+    int depth, size, num_slots, i;
+    
+    top = node;
+    stack = local_stack;
+    size = FREE_STACK_SIZE;
+    depth = 0;
+    for (;;) {
+        slots = child_slots(trie, node, &num_slots);
+        for (i = 0; i < num_slots; i++) {
+            if (!slots[i]) {
+                continue;
+            }
+            if (depth == size) {
+                if (stack == local_stack) {
+                    bigger_stack = (node_t **)malloc(sizeof(node_t *) * size * 2);
+                    if (bigger_stack) {
+                        memcpy(bigger_stack, stack, sizeof(node_t *) * size);
+                    }
+                } else {
+                    bigger_stack = (node_t **)realloc(stack, sizeof(node_t *) * size * 2);
+                }
+                if (!bigger_stack) {
+                    /*
+                     * Out of memory, this subtree is freed recursively instead.
+                     */
+                    free_children(trie, slots[i]);
+                    free_node(trie, slots[i]);
+                    continue;
+                }
+                stack = bigger_stack;
+                size *= 2;
+            }
+            stack[depth++] = slots[i];
+        }
+        if (node != top) {
+            free_node(trie, node);
+        }
+        if (depth == 0) {
+            break;
+        }
+        node = stack[--depth];
+    }
+    if (stack != local_stack) {
+        free(stack);
+    }
+}
+
+/**
+ * @brief Find the child with the smallest key index.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node. It must have at least one child.
+ * @param[out] index Key index of the child.
+ *
+ * @return Pointer to the slot holding the child.
+ */
+static node_t **first_child (trie_t *trie, node_t *node, unsigned char *index)
+{
+    return next_child(trie, node, 0, index);
+}
+
+/**
+ * @brief Find the child with the smallest key index not below a given one.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node Pointer to the node.
+ * @param[in] from Smallest key index to consider.
+ * @param[out] index Key index of the child.
+ *
+ * @return Pointer to the slot holding the child or NULL if there is no such child.
+ */
+static node_t **next_child (trie_t *trie, node_t *node, int from, unsigned char *index)
+{
+    unsigned char *keys;
+    node_t **children;
+    node48_t *node48;
+    node_full_t *node_full;
+    int i;
+    
+    switch (node->type) {
+        case NODE_4:
+        case NODE_16:
+            if (node->type == NODE_4) {
+                keys = ((node4_t *)node)->key;
+                children = ((node4_t *)node)->child;
+            } else {
+                keys = ((node16_t *)node)->key;
+                children = ((node16_t *)node)->child;
+            }
+            for (i = 0; i < node->num_children; i++) {
+                if (keys[i] >= from) {
+                    *index = keys[i];
+                    return &children[i];
+                }
+            }
+            break;
+        case NODE_48:
+            node48 = (node48_t *)node;
+            for (i = from; i < trie->alphabet_size; i++) {
+                if (node48->child_index[i]) {
+                    *index = i;
+                    return &node48->child[node48->child_index[i] - 1];
+                }
+            }
+            break;
+        case NODE_FULL:
+            node_full = (node_full_t *)node;
+            for (i = from; i < trie->alphabet_size; i++) {
+                if (node_full->child[i] && (node_full->child[i] != SEALED_CHILD)) {
+                    *index = i;
+                    return &node_full->child[i];
+                }
+            }
+            break;
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Add a child to a node, growing the node if it is full.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node_ref Slot pointing to the node. Updated if the node
+ *                 is replaced with a bigger one.
+ * @param[in] index Key index of the child. There must be no child for it yet.
+ * @param[in] child The child being added.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean add_child (trie_t *trie, node_t **node_ref, unsigned char index, node_t *child)
+{
+    node_t *node;
+    unsigned char *keys;
+    node_t **children;
+    node48_t *node48;
+    int i;
+    
+    node = *node_ref;
+    if (node_is_full(node)) {
+        node = resize_node(trie, node, grown_node_type(trie, node->type));
+        if (!node) {
+            return FALSE;
+        }
+        *node_ref = node;
+    }
+    
+    switch (node->type) {
+        case NODE_4:
+        case NODE_16:
+            if (node->type == NODE_4) {
+                keys = ((node4_t *)node)->key;
+                children = ((node4_t *)node)->child;
+            } else {
+                keys = ((node16_t *)node)->key;
+                children = ((node16_t *)node)->child;
+            }
+            /*
+             * Keep the keys sorted, shifting the bigger ones to the right.
+             */
+            for (i = node->num_children; (i > 0) && (keys[i - 1] > index); i--) {
+                keys[i] = keys[i - 1];
+                children[i] = children[i - 1];
+            }
+            keys[i] = index;
+            children[i] = child;
+            break;
+        case NODE_48:
+            node48 = (node48_t *)node;
+            for (i = 0; node48->child[i]; i++) {
+                ;
+            }
+            node48->child[i] = child;
+            node48->child_index[index] = i + 1;
+            break;
+        case NODE_FULL:
+            ((node_full_t *)node)->child[index] = child;
+            break;
+    }
+    node->num_children++;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Remove a child from a node, shrinking the node if it is sparse enough.
+ *
+ * @note The child itself is not freed.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node_ref Slot pointing to the node. Updated if the node
+ *                 is replaced with a smaller one.
+ * @param[in] index Key index of the child. The child must exist.
+ */
+static void remove_child (trie_t *trie, node_t **node_ref, unsigned char index)
+{
+    node_t *node, *smaller_node;
+    unsigned char *keys;
+    node_t **children;
+    node48_t *node48;
+    int i;
+    
+    node = *node_ref;
+    switch (node->type) {
+        case NODE_4:
+        case NODE_16:
+            if (node->type == NODE_4) {
+                keys = ((node4_t *)node)->key;
+                children = ((node4_t *)node)->child;
+            } else {
+                keys = ((node16_t *)node)->key;
+                children = ((node16_t *)node)->child;
+            }
+            for (i = 0; keys[i] != index; i++) {
+                ;
+            }
+            for (; i < node->num_children - 1; i++) {
+                keys[i] = keys[i + 1];
+                children[i] = children[i + 1];
+            }
+            children[i] = NULL;
+            break;
+        case NODE_48:
+            node48 = (node48_t *)node;
+            node48->child[node48->child_index[index] - 1] = NULL;
+            node48->child_index[index] = 0;
+            break;
+        case NODE_FULL:
+            /*
+             * A full node of a concurrent trie other than the root is sealed
+             * while it loses a child, so the slot stays sealed as well.
+             */
+            ((node_full_t *)node)->child[index] =
+                (trie->concurrent && (node_ref != &trie->child)) ? SEALED_CHILD : NULL;
+            break;
+    }
+    if (trie->concurrent) {
+        __atomic_fetch_sub(&node->num_children, 1, __ATOMIC_RELAXED);
+    } else {
+        node->num_children--;
+    }
+    
+    /*
+     * If the allocation of a smaller node fails we just carry on with the bigger one.
+     * The root stays a full node, so it never has to be replaced.
+     */
+    smaller_node = NULL;
+    if ((node->type == NODE_16) && (node->num_children <= NODE16_MIN_CHILD)) {
+        smaller_node = resize_node(trie, node, NODE_4);
+    } else if ((node->type == NODE_48) && (node->num_children <= NODE48_MIN_CHILD)) {
+        smaller_node = resize_node(trie, node, NODE_16);
+    } else if ((node->type == NODE_FULL) && (node->num_children <= NODE_FULL_MIN_CHILD(trie)) &&
+               (node_ref != &trie->child) && (node_ref != &trie->draft)) {
+        smaller_node = resize_node(trie, node,
+                                   (trie->alphabet_size > NODE48_MAX_CHILD) ? NODE_48 : NODE_16);
+    }
+    if (smaller_node) {
+        *node_ref = smaller_node;
+    }
+}
+
+/**
+ * @brief Allocate a node of a different type and prefix length holding the same
+ * children and value as a node.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node The node being copied. It is left untouched, except that a full
+ *            node of a concurrent trie is sealed, see seal_node(). The children
+ *            of a node of a persistent trie gain a reference.
+ * @param[in] type Type of the new node, it must be able to hold all the children.
+ * @param[in] prefix_len Prefix length of the new node. The prefix is left for the
+ *            caller to fill in.
+ *
+ * @return Pointer to the new node or NULL if memory allocation failed.
+ */
+static node_t *copy_node (trie_t *trie, node_t *node, node_type_t type, unsigned int prefix_len)
+{
+    node_t *new_node;
+    node_t **child_ref;
+    int i;
+    
+    new_node = alloc_node(trie, type, prefix_len);
+    if (!new_node) {
+        return NULL;
+    }
+    if (trie->concurrent && (node->type == NODE_FULL)) {
+        seal_node(trie, node);
+    }
+    new_node->has_value = node->has_value;
+    new_node->value = node->value;
+    new_node->max_value = node->max_value;
+    
+    /*
+     * Adding the children in key order keeps the small nodes sorted without
+     * any shifting.
+     */
+    for (i = 0; (i < trie->alphabet_size) && (new_node->num_children < node->num_children); i++) {
+        child_ref = find_child(node, i);
+        if (child_ref) {
+            if (trie->persistent) {
+                __atomic_fetch_add(&(*child_ref)->version, 1, __ATOMIC_RELAXED);
+            }
+            add_child(trie, &new_node, i, *child_ref);
+        }
+    }
+    
+    return new_node;
+}
+
+/**
+ * @brief Replace a node with a node of a different type holding the same
+ * prefix, children and value.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node The node being replaced. It is retired on success.
+ * @param[in] type Type of the new node, it must be able to hold all the children.
+ *
+ * @return Pointer to the new node or NULL if memory allocation failed, in which
+ * case the old node is left untouched.
+ */
+static node_t *resize_node (trie_t *trie, node_t *node, node_type_t type)
+{
+    node_t *new_node;
+    
+    new_node = copy_node(trie, node, type, node->prefix_len);
+    if (!new_node) {
+        return NULL;
+    }
+    memcpy(node_prefix(trie, new_node), node_prefix(trie, node), node->prefix_len);
+    retire_node(trie, node);
+    
+    return new_node;
+}
+
+/**
+ * @brief Allocate a node without children for the tail of a key.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] key The characters of the key that follow the edge to the new node.
+ * @param[in] size_of_key Number of characters in key.
+ * @param[in] value Value corresponding to the key.
+ *
+ * @return Pointer to the node or NULL if memory allocation failed or the key
+ * has a character that is not permitted.
+ */
+static node_t *new_leaf (trie_t *trie, const char *key, size_t size_of_key, int value)
+{
+    node_t *leaf;
+    unsigned char *prefix;
+    unsigned short index;
+    
+    leaf = alloc_node(trie, NODE_4, (unsigned int)size_of_key);
+    if (!leaf) {
+        return NULL;
+    }
+    prefix = node_prefix(trie, leaf);
+    for (size_t i = 0; i < size_of_key; i++) {
+        index = key_to_index(trie, key[i]);
+        if (index == INVALID_INDEX) {
+            free_node(trie, leaf);
+            return NULL;
+        }
+        prefix[i] = index;
+    }
+    leaf->value = value;
+    leaf->max_value = value;
+    leaf->has_value = TRUE;
+    
+    return leaf;
+}
+
+/**
+ * @brief Split a node within its prefix.
+ *
+ * @details
+ * The node is replaced with a new node holding the first matched characters of
+ * the prefix, whose only child is a copy of the node holding the characters of
+ * the prefix that follow the character on the edge between the two.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node_ref Slot pointing to the node. Updated to point to the
+ *                 new upper node.
+ * @param[in] matched Number of prefix characters that go to the upper node. It
+ *            must be less than the length of the prefix.
+ *
+ * @return Boolean indicating if we succeeded or not. The trie is left untouched
+ * on failure.
+ */
+static boolean split_node (trie_t *trie, node_t **node_ref, unsigned int matched)
+{
+    node_t *node, *upper, *lower;
+    unsigned char *prefix;
+    
+    node = *node_ref;
+    prefix = node_prefix(trie, node);
+    upper = alloc_node(trie, NODE_4, matched);
+    if (!upper) {
+        return FALSE;
+    }
+    lower = copy_node(trie, node, node->type, node->prefix_len - matched - 1);
+    if (!lower) {
+        free_node(trie, upper);
+        return FALSE;
+    }
+    upper->max_value = node->max_value;
+    memcpy(node_prefix(trie, upper), prefix, matched);
+    memcpy(node_prefix(trie, lower), prefix + matched + 1, lower->prefix_len);
+    add_child(trie, &upper, prefix[matched], lower);
+    retire_node(trie, node);
+    *node_ref = upper;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Merge a node that has no value and only one child into that child.
+ *
+ * @details
+ * The child is replaced with a copy whose prefix is the prefix of the node, the
+ * character on the edge and the prefix of the child. If memory allocation fails
+ * the two nodes are left as they are, which is still a valid trie.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node_ref Slot pointing to the node. Updated to point to the
+ *                 merged node.
+ */
+static void merge_with_child (trie_t *trie, node_t **node_ref)
+{
+    node_t *node, *child, *merged;
+    unsigned char index;
+    unsigned char *prefix;
+    
+    node = *node_ref;
+    child = *first_child(trie, node, &index);
+    merged = copy_node(trie, child, child->type, node->prefix_len + 1 + child->prefix_len);
+    if (!merged) {
+        return;
+    }
+    prefix = node_prefix(trie, merged);
+    memcpy(prefix, node_prefix(trie, node), node->prefix_len);
+    prefix[node->prefix_len] = index;
+    memcpy(prefix + node->prefix_len + 1, node_prefix(trie, child), child->prefix_len);
+    
+    /*
+     * The only reference to the child of a node of a persistent trie that goes
+     * away is the one from the node.
+     */
+    if (!trie->persistent) {
+        retire_node(trie, child);
+    }
+    retire_node(trie, node);
+    *node_ref = merged;
+}
+
+/**
+ * @brief Allocate and set up a trie.
+ *
+ * @param[in] alphabet The characters permitted in keys or NULL for all bytes.
+ * @param[in] slab_size Size of the slabs of the arena or 0 for no arena.
+ *
+ * @return Pointer to trie or NULL if memory allocation failed or the alphabet
+ * has duplicates.
+ */
+static trie_t *new_trie (const char *alphabet, size_t slab_size)
+{
+    trie_t *trie;
+    unsigned char ch;
+    int i;
+    
+    trie = (trie_t *) malloc (sizeof(trie_t));
+    if (!trie) {
+        return NULL;
+    }
+    trie->arena = NULL;
+    trie->concurrent = FALSE;
+    trie->persistent = FALSE;
+    trie->draft = NULL;
+    trie->retired = NULL;
+    trie->num_retired = 0;
+    trie->reclaiming = FALSE;
+    trie->epoch = 0;
+    trie->epoch_slots = NULL;
+    trie->path = NULL;
+    trie->path_size = 0;
+    for (i = 0; i < MAX_NUM_CHILD; i++) {
+        trie->char_to_index[i] = INVALID_INDEX;
+    }
+    if (alphabet) {
+        for (i = 0; alphabet[i]; i++) {
+            ch = (unsigned char)alphabet[i];
+            if (trie->char_to_index[ch] != INVALID_INDEX) {
+                free(trie);
+                
+                return NULL;
+            }
+            trie->char_to_index[ch] = i;
+            trie->index_to_char[i] = ch;
+        }
+        trie->alphabet_size = i;
+    } else {
+        for (i = 0; i < MAX_NUM_CHILD; i++) {
+            trie->char_to_index[i] = i;
+            trie->index_to_char[i] = i;
+        }
+        trie->alphabet_size = MAX_NUM_CHILD;
+    }
+    
+    if (slab_size) {
+        trie->arena = create_arena(slab_size);
+        if (!trie->arena) {
+            free(trie);
+            
+            return NULL;
+        }
+    }
+    
+    /*
+     * The first level is usually dense, so start the root off as a full node.
+     */
+    trie->child = alloc_node(trie, NODE_FULL, 0);
+    if (!trie->child) {
+        if (trie->arena) {
+            destroy_arena(trie->arena);
+        }
+        free(trie);
+        
+        return NULL;
+    }
+    
+    return trie;
+}
+
+/**
+ * @brief Put a node on the stack of a cursor.
+ *
+ * @details
+ * The character on the edge to the node is expected at key_len - 1 of the
+ * key, the prefix of the node is added after it. There must be enough room
+ * for the prefix in the key.
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[in] node Pointer to the node.
+ * @param[in] key_len Length of the key up to the prefix of the node.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean iter_push (trie_iter_t *iter, node_t *node, size_t key_len)
+{
+    iter_frame_t *stack;
+    trie_t *trie;
+    unsigned char *prefix;
+    unsigned int j;
+    
+    trie = iter->trie;
+    if (iter->depth == iter->stack_size) {
+        stack = (iter_frame_t *)realloc(iter->stack,
+                                        sizeof(iter_frame_t) * iter->stack_size * 2);
+        if (!stack) {
+            return FALSE;
+        }
+        iter->stack = stack;
+        iter->stack_size *= 2;
+    }
+    if (iter->depth > 0) {
+        iter->key[key_len - 1] = trie->index_to_char[iter->stack[iter->depth - 1].next - 1];
+        prefix = node_prefix(trie, node);
+        for (j = 0; j < node->prefix_len; j++) {
+            iter->key[key_len + j] = trie->index_to_char[prefix[j]];
+        }
+        key_len += node->prefix_len;
+    }
+    iter->stack[iter->depth].node = node;
+    iter->stack[iter->depth].next = -1;
+    iter->stack[iter->depth].key_len = key_len;
+    iter->depth++;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Make sure the key of a cursor has room for a number of characters.
+ *
+ * @param[in, out] key The key, reallocated if it is too small.
+ * @param[in, out] key_size Number of bytes allocated for the key.
+ * @param[in] key_len Number of characters.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean reserve_key (char **key, size_t *key_size, size_t key_len)
+{
+    char *bigger_key;
+    size_t size;
+    
+    if (key_len <= *key_size) {
+        return TRUE;
+    }
+    for (size = *key_size; size < key_len; size *= 2) {
+        ;
+    }
+    bigger_key = (char *)realloc(*key, size);
+    if (!bigger_key) {
+        return FALSE;
+    }
+    *key = bigger_key;
+    *key_size = size;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Make sure the path of a trie has room for the node at a depth.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] depth Depth of the node, 0 being the root.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean grow_path (trie_t *trie, unsigned int depth)
+{
+    node_t **path;
+    unsigned int path_size;
+    
+    if (depth < trie->path_size) {
+        return TRUE;
+    }
+    path_size = trie->path_size ? trie->path_size * 2 : ITER_STACK_SIZE;
+    path = (node_t **)realloc(trie->path, sizeof(node_t *) * path_size);
+    if (!path) {
+        return FALSE;
+    }
+    trie->path = path;
+    trie->path_size = path_size;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Work out the largest value stored in a node or below it again.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in, out] node Pointer to the node.
+ */
+static void refresh_max_value (trie_t *trie, node_t *node)
+{
+    node_t **slots;
+    int num_slots, i;
+    int max_value;
+    
+    max_value = node->has_value ? node->value : INT_MIN;
+    slots = child_slots(trie, node, &num_slots);
+    for (i = 0; i < num_slots; i++) {
+        if (slots[i] && (slots[i]->max_value > max_value)) {
+            max_value = slots[i]->max_value;
+        }
+    }
+    node->max_value = max_value;
+}
+
+/**
+ * @brief Bring the cached largest values up to date after the largest value
+ * below a node went away or became smaller.
+ *
+ * @details
+ * The node at the bottom of the path may be a new node and is always worked
+ * out again. Going up, only the nodes whose largest value was the old value
+ * can change and once one of them doesn't change, nothing above it does.
+ *
+ * @param[in] trie Pointer to the trie, the path of which holds the nodes from
+ *            the root down.
+ * @param[in] depth Depth of the node at the bottom of the path.
+ * @param[in] old_value The value that went away.
+ */
+static void lower_max_values (trie_t *trie, unsigned int depth, int old_value)
+{
+    node_t *node;
+    
+    refresh_max_value(trie, trie->path[depth]);
+    while (depth-- > 0) {
+        node = trie->path[depth];
+        if (node->max_value != old_value) {
+            break;
+        }
+        refresh_max_value(trie, node);
+        if (node->max_value == old_value) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Find the node below which all the keys with a particular prefix are.
+ *
+ * @details
+ * The prefix may end part way through the prefix of the node.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] prefix The prefix, it need not be NUL terminated.
+ * @param[in] size_of_prefix Number of characters in the prefix.
+ * @param[out] key_len Length of the key of the node, at least size_of_prefix.
+ *
+ * @return Pointer to the node or NULL if no key has the prefix.
+ */
+static node_t *find_prefix_node (trie_t *trie, const char *prefix, size_t size_of_prefix,
+                                 size_t *key_len)
+{
+    node_t *node;
+    node_t **child_ref;
+    unsigned char *node_key;
+    unsigned short index;
+    unsigned int j;
+    size_t i;
+    
+    node = trie->child;
+    i = 0;
+    for (;;) {
+        node_key = node_prefix(trie, node);
+        for (j = 0; (j < node->prefix_len) && (i + j < size_of_prefix); j++) {
+            if (node_key[j] != key_to_index(trie, prefix[i + j])) {
+                return NULL;
+            }
+        }
+        i += node->prefix_len;
+        if (i >= size_of_prefix) {
+            break;
+        }
+        index = key_to_index(trie, prefix[i]);
+        if (index == INVALID_INDEX) {
+            return NULL;
+        }
+        child_ref = find_child(node, index);
+        if (!child_ref) {
+            return NULL;
+        }
+        node = *child_ref;
+        i++;
+    }
+    *key_len = i;
+    
+    return node;
+}
+
+/**
+ * @brief Fill in the key of the node found for a prefix.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] node The node found by find_prefix_node().
+ * @param[in] prefix The prefix.
+ * @param[in] size_of_prefix Number of characters in the prefix.
+ * @param[in] key_len Length of the key of the node.
+ * @param[out] key Buffer for the key.
+ * @param[in] key_size Number of bytes in the buffer, only the characters that
+ *            fit are filled in.
+ */
+static void copy_prefix_key (trie_t *trie, node_t *node, const char *prefix,
+                             size_t size_of_prefix, size_t key_len, char *key,
+                             size_t key_size)
+{
+    unsigned char *node_key;
+    size_t i, len;
+    
+    len = (key_len < key_size) ? key_len : key_size;
+    
+    /*
+     * The characters of the prefix are mapped back and forth so they come out
+     * the way they are stored.
+     */
+    for (i = 0; (i < size_of_prefix) && (i < len); i++) {
+        key[i] = trie->index_to_char[key_to_index(trie, prefix[i])];
+    }
+    node_key = node_prefix(trie, node) + node->prefix_len - (key_len - size_of_prefix);
+    for (; i < len; i++) {
+        key[i] = trie->index_to_char[node_key[i - size_of_prefix]];
+    }
+}
+
+/**
+ * @brief Tell if an entry of a top K search goes before another.
+ *
+ * @details
+ * A value goes before a node with the same score, it can be reported right away.
+ *
+ * @param[in] a Pointer to an entry.
+ * @param[in] b Pointer to the other entry.
+ *
+ * @return TRUE if a goes first.
+ */
+static boolean top_k_before (top_k_entry_t *a, top_k_entry_t *b)
+{
+    if (a->score != b->score) {
+        return (a->score > b->score);
+    }
+    
+    return (a->is_value && !b->is_value);
+}
+
+/**
+ * @brief Add an entry to the heap of a top K search.
+ *
+ * @param[in, out] heap Pointer to the heap, which is reallocated if it is full.
+ * @param[in, out] heap_len Number of entries in the heap.
+ * @param[in, out] heap_size Number of entries the heap has room for.
+ * @param[in] entry The entry.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean top_k_push (top_k_entry_t **heap, size_t *heap_len, size_t *heap_size,
+                           top_k_entry_t *entry)
+{
+    top_k_entry_t *bigger_heap;
+    size_t i, parent;
+    
+    if (*heap_len == *heap_size) {
+        bigger_heap = (top_k_entry_t *)realloc(*heap, sizeof(top_k_entry_t) * *heap_size * 2);
+        if (!bigger_heap) {
+            return FALSE;
+        }
+        *heap = bigger_heap;
+        *heap_size *= 2;
+    }
+    for (i = (*heap_len)++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!top_k_before(entry, &(*heap)[parent])) {
+            break;
+        }
+        (*heap)[i] = (*heap)[parent];
+    }
+    (*heap)[i] = *entry;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Take the first entry off the heap of a top K search.
+ *
+ * @param[in, out] heap Pointer to the heap, which must not be empty.
+ * @param[in, out] heap_len Number of entries in the heap.
+ * @param[out] entry The entry.
+ */
+static void top_k_pop (top_k_entry_t *heap, size_t *heap_len, top_k_entry_t *entry)
+{
+    top_k_entry_t *last;
+    size_t i, child;
+    
+    *entry = heap[0];
+    last = &heap[--(*heap_len)];
+    for (i = 0; (child = 2 * i + 1) < *heap_len; i = child) {
+        if ((child + 1 < *heap_len) && top_k_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!top_k_before(&heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+    }
+    heap[i] = *last;
+}
+
+/**
+ * @brief Write a node of a trie being saved.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] file The file being written.
+ * @param[in] frame The node, with all of its children written.
+ * @param[in, out] offset Offset the node is written at, moved past it.
+ *
+ * @return Offset of the node or 0 if writing failed.
+ */
+static uint64_t write_mapped_node (trie_t *trie, FILE *file, save_frame_t *frame,
+                                   uint64_t *offset)
+{
+    static const char padding[MAPPED_ALIGN];
+    mapped_node_t mapped;
+    node_t *node;
+    uint64_t node_offset;
+    size_t size;
+    
+    node = frame->node;
+    mapped.has_value = node->has_value;
+    mapped.value = node->value;
+    mapped.prefix_len = node->prefix_len;
+    mapped.num_children = frame->num_children;
+    size = sizeof(mapped_node_t) + (sizeof(uint64_t) + 1) * frame->num_children +
+           node->prefix_len;
+    if ((fwrite(&mapped, sizeof(mapped_node_t), 1, file) != 1) ||
+        (fwrite(frame->child, sizeof(uint64_t), frame->num_children, file) !=
+         frame->num_children) ||
+        (fwrite(frame->key, 1, frame->num_children, file) != frame->num_children) ||
+        (fwrite(node_prefix(trie, node), 1, node->prefix_len, file) != node->prefix_len) ||
+        (fwrite(padding, 1, (MAPPED_ALIGN - size % MAPPED_ALIGN) % MAPPED_ALIGN, file) !=
+         (MAPPED_ALIGN - size % MAPPED_ALIGN) % MAPPED_ALIGN)) {
+        return 0;
+    }
+    node_offset = *offset;
+    *offset += (size + MAPPED_ALIGN - 1) & ~(size_t)(MAPPED_ALIGN - 1);
+    
+    return node_offset;
+}
+
+/**
+ * @brief Get to a node of a mapped trie by its offset, making sure all of it
+ * is inside the mapping.
+ *
+ * @details
+ * The file may have been cut short or changed by anybody who can write it, so
+ * an offset read from it is only followed once the node, its children, their
+ * key indices and its prefix are known to be inside the mapping.
+ *
+ * @param[in] mtrie Pointer to the mapped trie.
+ * @param[in] offset Offset of the node in the file.
+ *
+ * @return Pointer to the node or NULL if it isn't all inside the mapping.
+ */
+static const mapped_node_t *mapped_node_at (mapped_trie_t *mtrie, uint64_t offset)
+{
+    const mapped_node_t *node;
+    
+    if ((offset % MAPPED_ALIGN) || (offset < sizeof(mapped_header_t)) ||
+        (offset > mtrie->size - sizeof(mapped_node_t))) {
+        return NULL;
+    }
+    node = (const mapped_node_t *)(mtrie->base + offset);
+    if ((node->num_children > MAX_NUM_CHILD) ||
+        ((uint64_t)node->num_children * (sizeof(uint64_t) + 1) + node->prefix_len >
+         mtrie->size - sizeof(mapped_node_t) - offset)) {
+        return NULL;
+    }
+    
+    return node;
+}
+
+/**
+ * @brief Find the child of a node of a mapped trie for a key index.
+ *
+ * @param[in] mtrie Pointer to the mapped trie.
+ * @param[in] node Pointer to the node.
+ * @param[in] index The key index.
+ *
+ * @return Pointer to the child or NULL if there is no such child or it isn't
+ * all inside the mapping.
+ */
+static const mapped_node_t *find_mapped_child (mapped_trie_t *mtrie, const mapped_node_t *node,
+                                               unsigned char index)
+{
+    const uint64_t *children;
+    const unsigned char *keys;
+    unsigned int low, high, mid;
+    
+    children = (const uint64_t *)(node + 1);
+    keys = (const unsigned char *)(children + node->num_children);
+    low = 0;
+    high = node->num_children;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (keys[mid] < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if ((low == node->num_children) || (keys[low] != index)) {
+        return NULL;
+    }
+    
+    return mapped_node_at(mtrie, children[low]);
+}
+
+/**
+ * @brief List the nodes of a trie in breadth first order.
+ *
+ * @details
+ * The children of a node come in the order of their key indices. The list is
+ * also the queue of the walk.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[out] num_nodes Number of nodes.
+ *
+ * @return The nodes, the root first, or NULL if memory allocation failed.
+ */
+static node_t **breadth_first_order (trie_t *trie, size_t *num_nodes)
+{
+    node_t **order, **bigger_order, **child_ref;
+    node_t *node;
+    size_t order_size, i;
+    unsigned char index;
+    
+    order_size = ORDER_SIZE;
+    order = (node_t **)malloc(sizeof(node_t *) * order_size);
+    if (!order) {
+        return NULL;
+    }
+    order[0] = trie->child;
+    *num_nodes = 1;
+    for (i = 0; i < *num_nodes; i++) {
+        node = order[i];
+        for (child_ref = next_child(trie, node, 0, &index); child_ref;
+             child_ref = next_child(trie, node, index + 1, &index)) {
+            if (*num_nodes == order_size) {
+                bigger_order = (node_t **)realloc(order, sizeof(node_t *) * order_size * 2);
+                if (!bigger_order) {
+                    free(order);
+                    return NULL;
+                }
+                order = bigger_order;
+                order_size *= 2;
+            }
+            order[(*num_nodes)++] = *child_ref;
+        }
+    }
+    
+    return order;
+}
+
+/**
+ * @brief Allocate the bits of a bitvector, all clear.
+ *
+ * @param[out] bits Pointer to the bitvector.
+ * @param[in] num_bits Number of bits.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean init_bitvector (bitvector_t *bits, size_t num_bits)
+{
+    bits->num_bits = num_bits;
+    bits->ranks = NULL;
+    bits->zeros = NULL;
+    
+    /*
+     * Whole blocks, so counting the bits of a block never goes past the end.
+     */
+    bits->words = (uint64_t *)calloc((num_bits / RANK_BLOCK_BITS + 1) * (RANK_BLOCK_BITS / 64),
+                                     sizeof(uint64_t));
+                                     
+    return bits->words ? TRUE : FALSE;
+}
+
+/**
+ * @brief Build the directory of a bitvector once its bits are set.
+ *
+ * @param[in, out] bits Pointer to the bitvector.
+ * @param[in] with_zeros Boolean indicating if zeros are to be found by number.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean index_bitvector (bitvector_t *bits, boolean with_zeros)
+{
+    size_t num_blocks, num_zeros, block, pos;
+    uint32_t ones;
+    unsigned int i;
+    
+    num_blocks = bits->num_bits / RANK_BLOCK_BITS + 1;
+    bits->ranks = (uint32_t *)malloc(sizeof(uint32_t) * (num_blocks + 1));
+    if (!bits->ranks) {
+        return FALSE;
+    }
+    ones = 0;
+    for (block = 0; block < num_blocks; block++) {
+        bits->ranks[block] = ones;
+        for (i = 0; i < RANK_BLOCK_BITS / 64; i++) {
+            ones += (uint32_t)__builtin_popcountll(bits->words[block * (RANK_BLOCK_BITS / 64) + i]);
+        }
+    }
+    bits->ranks[num_blocks] = ones;
+    if (!with_zeros) {
+        return TRUE;
+    }
+    
+    bits->zeros = (uint32_t *)malloc(sizeof(uint32_t) *
+                                     ((bits->num_bits - ones) / SELECT_SAMPLE + 1));
+    if (!bits->zeros) {
+        return FALSE;
+    }
+    num_zeros = 0;
+    for (pos = 0; pos < bits->num_bits; pos++) {
+        if (!(bits->words[pos / 64] & ((uint64_t)1 << (pos % 64)))) {
+            if (num_zeros % SELECT_SAMPLE == 0) {
+                bits->zeros[num_zeros / SELECT_SAMPLE] = (uint32_t)pos;
+            }
+            num_zeros++;
+        }
+    }
+    
+    return TRUE;
+}
+
+/**
+ * @brief Free the bits and directory of a bitvector.
+ *
+ * @param[in] bits Pointer to the bitvector.
+ */
+static void free_bitvector (bitvector_t *bits)
+{
+    free(bits->words);
+    free(bits->ranks);
+    free(bits->zeros);
+}
+
+/**
+ * @brief Count the bits set before a position of a bitvector.
+ *
+ * @param[in] bits Pointer to the bitvector.
+ * @param[in] pos The position.
+ *
+ * @return Number of bits set before the position.
+ */
+static size_t rank_bitvector (bitvector_t *bits, size_t pos)
+{
+    size_t rank, word;
+    
+    rank = bits->ranks[pos / RANK_BLOCK_BITS];
+    for (word = pos / RANK_BLOCK_BITS * (RANK_BLOCK_BITS / 64); word < pos / 64; word++) {
+        rank += __builtin_popcountll(bits->words[word]);
+    }
+    if (pos % 64) {
+        rank += __builtin_popcountll(bits->words[word] & (((uint64_t)1 << (pos % 64)) - 1));
+    }
+    
+    return rank;
+}
+
+/**
+ * @brief Find a zero of a bitvector by its number.
+ *
+ * @details
+ * Start from the block of the closest sampled zero, skip the blocks that end
+ * before the zero using the directory and count the zeros of the words of
+ * the last block.
+ *
+ * @param[in] bits Pointer to the bitvector, indexed with zeros.
+ * @param[in] num Number of the zero, the first one being 1. There must be at
+ *            least as many zeros.
+ *
+ * @return Position of the zero.
+ */
+static size_t select_zero (bitvector_t *bits, size_t num)
+{
+    uint64_t zeros;
+    size_t block, word, seen, count;
+    
+    block = bits->zeros[(num - 1) / SELECT_SAMPLE] / RANK_BLOCK_BITS;
+    while ((block + 1) * RANK_BLOCK_BITS - bits->ranks[block + 1] < num) {
+        block++;
+    }
+    seen = block * RANK_BLOCK_BITS - bits->ranks[block];
+    for (word = block * (RANK_BLOCK_BITS / 64); ; word++) {
+        count = 64 - __builtin_popcountll(bits->words[word]);
+        if (seen + count >= num) {
+            break;
+        }
+        seen += count;
+    }
+    zeros = ~bits->words[word];
+    for (; seen + 1 < num; seen++) {
+        zeros &= zeros - 1;
+    }
+    
+    return word * 64 + __builtin_ctzll(zeros);
+}
+
+/**
+ * @brief Find the first zero of a bitvector at or after a position.
+ *
+ * @param[in] bits Pointer to the bitvector. There must be such a zero.
+ * @param[in] pos The position.
+ *
+ * @return Position of the zero.
+ */
+static size_t next_zero (bitvector_t *bits, size_t pos)
+{
+    uint64_t zeros;
+    size_t word;
+    
+    word = pos / 64;
+    zeros = ~bits->words[word] & (~(uint64_t)0 << (pos % 64));
+    while (!zeros) {
+        zeros = ~bits->words[++word];
+    }
+    
+    return word * 64 + __builtin_ctzll(zeros);
+}
+
+/**
+ * @brief Find the children of a node of a LOUDS trie.
+ *
+ * @details
+ * The child at position pos is node pos - node - 1, as there are node + 1
+ * zeros before it.
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ * @param[in] node Number of the node.
+ * @param[out] start Position of the first child.
+ * @param[out] end Position after the last child.
+ */
+static void louds_children (louds_trie_t *louds, uint32_t node, size_t *start, size_t *end)
+{
+    *start = select_zero(&louds->louds, (size_t)node + 1) + 1;
+    *end = next_zero(&louds->louds, *start);
+}
+
+/**
+ * @brief Find the prefix of a node of a LOUDS trie.
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ * @param[in] node Number of the node.
+ * @param[out] prefix Key indices of the prefix.
+ *
+ * @return Length of the prefix.
+ */
+static uint32_t louds_prefix (louds_trie_t *louds, uint32_t node, unsigned char **prefix)
+{
+    size_t rank;
+    
+    if (!(louds->has_prefix.words[node / 64] & ((uint64_t)1 << (node % 64)))) {
+        *prefix = louds->prefixes;
+        return 0;
+    }
+    rank = rank_bitvector(&louds->has_prefix, node);
+    *prefix = louds->prefixes + louds->prefix_starts[rank];
+    
+    return louds->prefix_starts[rank + 1] - louds->prefix_starts[rank];
+}
+
+/**
+ * @brief Find the child of a node of a LOUDS trie for a key index.
+ *
+ * @param[in] louds Pointer to the LOUDS trie.
+ * @param[in, out] node Number of the node, replaced with the number of the
+ *                 child.
+ * @param[in] index The key index, INVALID_INDEX for a character that isn't
+ *            permitted in a key.
+ *
+ * @return Boolean indicating if there is such a child or not.
+ */
+static boolean find_louds_child (louds_trie_t *louds, uint32_t *node, unsigned short index)
+{
+    size_t start, end, low, high, mid;
+    
+    if (index == INVALID_INDEX) {
+        return FALSE;
+    }
+    louds_children(louds, *node, &start, &end);
+    low = start - *node - 1;
+    high = end - *node - 1;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (louds->labels[mid] < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if ((low == end - *node - 1) || (louds->labels[low] != index)) {
+        return FALSE;
+    }
+    *node = (uint32_t)low;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Put a node on the stack of a cursor of a LOUDS trie.
+ *
+ * @details
+ * As iter_push().
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[in] node Number of the node.
+ * @param[in] key_len Length of the key up to the prefix of the node.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean louds_iter_push (louds_iter_t *iter, uint32_t node, size_t key_len)
+{
+    louds_trie_t *louds;
+    louds_frame_t *stack;
+    unsigned char *prefix;
+    uint32_t prefix_len, j;
+    
+    louds = iter->louds;
+    if (iter->depth == iter->stack_size) {
+        stack = (louds_frame_t *)realloc(iter->stack,
+                                         sizeof(louds_frame_t) * iter->stack_size * 2);
+        if (!stack) {
+            return FALSE;
+        }
+        iter->stack = stack;
+        iter->stack_size *= 2;
+    }
+    if (iter->depth > 0) {
+        iter->key[key_len - 1] = louds->index_to_char[louds->labels[node]];
+        prefix_len = louds_prefix(louds, node, &prefix);
+        for (j = 0; j < prefix_len; j++) {
+            iter->key[key_len + j] = louds->index_to_char[prefix[j]];
+        }
+        key_len += prefix_len;
+    }
+    iter->stack[iter->depth].node = node;
+    iter->stack[iter->depth].visited = FALSE;
+    louds_children(louds, node, &iter->stack[iter->depth].next, &iter->stack[iter->depth].end);
+    iter->stack[iter->depth].key_len = key_len;
+    iter->depth++;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Find the child of a node of a frozen trie for a key index.
+ *
+ * @param[in] frozen Pointer to the frozen trie.
+ * @param[in] node Pointer to the node.
+ * @param[in] index The key index, INVALID_INDEX for a character that isn't
+ *            permitted in a key.
+ *
+ * @return Pointer to the child or NULL if there is no such child.
+ */
+static frozen_node_t *find_frozen_child (frozen_trie_t *frozen, frozen_node_t *node,
+                                         unsigned short index)
+{
+    uint64_t *bitmap;
+    uint64_t bit;
+    uint32_t rank;
+    unsigned int word, i;
+    
+    if (index == INVALID_INDEX) {
+        return NULL;
+    }
+    bitmap = frozen->bitmaps + node->bitmap;
+    word = index / FROZEN_WORD_BITS;
+    bit = (uint64_t)1 << (index % FROZEN_WORD_BITS);
+    if (!(bitmap[word] & bit)) {
+        return NULL;
+    }
+    rank = (uint32_t)__builtin_popcountll(bitmap[word] & (bit - 1));
+    for (i = 0; i < word; i++) {
+        rank += (uint32_t)__builtin_popcountll(bitmap[i]);
+    }
+    
+    return &frozen->nodes[node->first_child + rank];
+}
+
+/**
+ * @brief Find the smallest key index of a child of a node of a frozen trie
+ * not below a given one.
+ *
+ * @param[in] frozen Pointer to the frozen trie.
+ * @param[in] node Pointer to the node.
+ * @param[in] from Smallest key index to consider.
+ *
+ * @return The key index or -1 if there is no such child.
+ */
+static int next_frozen_index (frozen_trie_t *frozen, frozen_node_t *node, int from)
+{
+    uint64_t *bitmap;
+    uint64_t bits;
+    unsigned int word;
+    
+    word = (unsigned int)from / FROZEN_WORD_BITS;
+    if (word >= frozen->bitmap_words) {
+        return -1;
+    }
+    bitmap = frozen->bitmaps + node->bitmap;
+    bits = bitmap[word] & (~(uint64_t)0 << (from % FROZEN_WORD_BITS));
+    while (!bits) {
+        if (++word == frozen->bitmap_words) {
+            return -1;
+        }
+        bits = bitmap[word];
+    }
+    
+    return (int)(word * FROZEN_WORD_BITS) + __builtin_ctzll(bits);
+}
+
+/**
+ * @brief Put a node on the stack of a cursor of a frozen trie.
+ *
+ * @details
+ * As iter_push().
+ *
+ * @param[in, out] iter Pointer to the cursor.
+ * @param[in] node Index of the node.
+ * @param[in] key_len Length of the key up to the prefix of the node.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean frozen_iter_push (frozen_iter_t *iter, uint32_t node, size_t key_len)
+{
+    frozen_trie_t *frozen;
+    frozen_frame_t *stack;
+    frozen_node_t *frozen_node;
+    unsigned char *prefix;
+    unsigned int j;
+    
+    frozen = iter->frozen;
+    if (iter->depth == iter->stack_size) {
+        stack = (frozen_frame_t *)realloc(iter->stack,
+                                          sizeof(frozen_frame_t) * iter->stack_size * 2);
+        if (!stack) {
+            return FALSE;
+        }
+        iter->stack = stack;
+        iter->stack_size *= 2;
+    }
+    frozen_node = &frozen->nodes[node];
+    if (iter->depth > 0) {
+        iter->key[key_len - 1] = frozen->index_to_char[iter->stack[iter->depth - 1].next - 1];
+        prefix = frozen->prefixes + frozen_node->prefix;
+        for (j = 0; j < frozen_node->prefix_len; j++) {
+            iter->key[key_len + j] = frozen->index_to_char[prefix[j]];
+        }
+        key_len += frozen_node->prefix_len;
+    }
+    iter->stack[iter->depth].node = node;
+    iter->stack[iter->depth].next = -1;
+    iter->stack[iter->depth].child = frozen_node->first_child;
+    iter->stack[iter->depth].key_len = key_len;
+    iter->depth++;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Make the arrays of a double-array trie being built bigger.
+ *
+ * @details
+ * The new cells are free and go on the end of the list of free cells.
+ *
+ * @param[in, out] builder Pointer to the builder.
+ * @param[in] size Number of cells needed.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean grow_double_array (double_array_builder_t *builder, size_t size)
+{
+    double_array_trie_t *da;
+    int32_t *base, *check, *next_free, *prev_free;
+    unsigned char *failures;
+    size_t new_size, cell;
+    
+    da = builder->da;
+    if (size <= da->size) {
+        return TRUE;
+    }
+    for (new_size = da->size ? da->size : size; new_size < size; new_size *= 2) {
+        ;
+    }
+    if (new_size > INT32_MAX) {
+        return FALSE;
+    }
+    base = (int32_t *)realloc(da->base, sizeof(int32_t) * new_size);
+    if (base) {
+        da->base = base;
+    }
+    check = (int32_t *)realloc(da->check, sizeof(int32_t) * new_size);
+    if (check) {
+        da->check = check;
+    }
+    next_free = (int32_t *)realloc(builder->next_free, sizeof(int32_t) * new_size);
+    if (next_free) {
+        builder->next_free = next_free;
+    }
+    prev_free = (int32_t *)realloc(builder->prev_free, sizeof(int32_t) * new_size);
+    if (prev_free) {
+        builder->prev_free = prev_free;
+    }
+    failures = (unsigned char *)realloc(builder->failures, new_size);
+    if (failures) {
+        builder->failures = failures;
+    }
+    if (!base || !check || !next_free || !prev_free || !failures) {
+        return FALSE;
+    }
+    
+    for (cell = da->size; cell < new_size; cell++) {
+        da->base[cell] = 0;
+        da->check[cell] = DOUBLE_ARRAY_FREE;
+        builder->failures[cell] = 0;
+        builder->next_free[cell] = -1;
+        builder->prev_free[cell] = builder->free_tail;
+        if (builder->free_tail >= 0) {
+            builder->next_free[builder->free_tail] = (int32_t)cell;
+        } else {
+            builder->free_head = (int32_t)cell;
+        }
+        builder->free_tail = (int32_t)cell;
+    }
+    da->size = new_size;
+    
+    return TRUE;
+}
+
+/**
+ * @brief Take a cell of a double-array trie being built off the list of
+ * free cells, if it is still on it.
+ *
+ * @param[in, out] builder Pointer to the builder.
+ * @param[in] cell The cell.
+ */
+static void take_double_array_cell (double_array_builder_t *builder, int32_t cell)
+{
+    int32_t prev, next;
+    
+    prev = builder->prev_free[cell];
+    if (prev == DOUBLE_ARRAY_UNLISTED) {
+        return;
+    }
+    next = builder->next_free[cell];
+    if (prev >= 0) {
+        builder->next_free[prev] = next;
+    } else {
+        builder->free_head = next;
+    }
+    if (next >= 0) {
+        builder->prev_free[next] = prev;
+    } else {
+        builder->free_tail = prev;
+    }
+    builder->prev_free[cell] = DOUBLE_ARRAY_UNLISTED;
+}
+
+/**
+ * @brief Find a base for the children of a state of a double-array trie
+ * being built.
+ *
+ * @details
+ * The cell of the smallest code is tried at each free cell in turn, until
+ * the cells of all the other codes are free too. The arrays grow if the
+ * cells go past their end.
+ *
+ * @param[in, out] builder Pointer to the builder.
+ * @param[in] codes Codes of the children in increasing order.
+ * @param[in] num_codes Number of codes, at least 1.
+ * @param[out] base The base.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean find_double_array_base (double_array_builder_t *builder, const int *codes,
+                                       int num_codes, int32_t *base)
+{
+    double_array_trie_t *da;
+    int32_t cell, next;
+    size_t slot;
+    int i;
+    
+    da = builder->da;
+    for (cell = builder->free_head; ; cell = next) {
+        if (cell < 0) {
+            /*
+             * Nothing fits, start the children past the end.
+             */
+            *base = (int32_t)da->size - codes[0];
+            break;
+        }
+        next = builder->next_free[cell];
+        if (cell < codes[0]) {
+            /*
+             * A base must not be negative, lookups add any code to it.
+             */
+            continue;
+        }
+        *base = cell - codes[0];
+        for (i = 1; i < num_codes; i++) {
+            slot = (size_t)(*base + codes[i]);
+            if ((slot < da->size) && (da->check[slot] != DOUBLE_ARRAY_FREE)) {
+                break;
+            }
+        }
+        if (i == num_codes) {
+            break;
+        }
+        if (++builder->failures[cell] == DOUBLE_ARRAY_MAX_FAILURES) {
+            take_double_array_cell(builder, cell);
+        }
+    }
+    if (!grow_double_array(builder, (size_t)(*base + codes[num_codes - 1]) + 1)) {
+        return FALSE;
+    }
+    if (*base > builder->max_base) {
+        builder->max_base = *base;
+    }
+    
+    return TRUE;
+}
+
+/**
+ * @brief Make the nodes of a load that no key can go below any more.
+ *
+ * @details
+ * Those are the open nodes whose keys are longer than what the next key has
+ * in common with the last one. A node whose prefix the next key parts from
+ * part way through is split: the part below is made and the open node is
+ * cut back to end where the keys part.
+ *
+ * @param[in, out] loader Pointer to the loader.
+ * @param[in] matched Number of characters the next key has in common with
+ *            the last one.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean close_load_frames (trie_loader_t *loader, size_t matched)
+{
+    load_frame_t *frame, *parent;
+    node_t *node;
+    
+    while ((loader->depth > 1) && (loader->stack[loader->depth - 1].depth > matched)) {
+        frame = &loader->stack[loader->depth - 1];
+        parent = &loader->stack[loader->depth - 2];
+        if (parent->depth < matched) {
+            node = finish_load_frame(loader, frame, matched);
+            if (!node) {
+                return FALSE;
+            }
+            frame->depth = matched;
+            frame->has_value = FALSE;
+            frame->num_children = 1;
+            frame->key[0] = (unsigned char)loader->key[matched];
+            frame->child[0] = node;
+            break;
+        }
+        node = finish_load_frame(loader, frame, parent->depth);
+        if (!node) {
+            return FALSE;
+        }
+        parent->key[parent->num_children] = frame->index;
+        parent->child[parent->num_children] = node;
+        parent->num_children++;
+        loader->depth--;
+    }
+    
+    return TRUE;
+}
+
+/**
+ * @brief Make the node of an open node of a load.
+ *
+ * @param[in] loader Pointer to the loader.
+ * @param[in] frame The open node, its children are handed over to the node.
+ * @param[in] start Length of the key of the parent. The character after it is
+ *            on the edge to the node and the rest up to the depth of the open
+ *            node make the prefix.
+ *
+ * @return Pointer to the node or NULL if memory allocation failed.
+ */
+static node_t *finish_load_frame (trie_loader_t *loader, load_frame_t *frame, size_t start)
+{
+    trie_t *trie;
+    node_t *node;
+    node_type_t type;
+    unsigned int i;
+    
+    trie = loader->trie;
+    type = NODE_4;
+    while ((type != NODE_FULL) &&
+           (frame->num_children > ((type == NODE_4) ? NODE4_MAX_CHILD :
+                                   (type == NODE_16) ? NODE16_MAX_CHILD : NODE48_MAX_CHILD))) {
+        type = grown_node_type(trie, type);
+    }
+    node = alloc_node(trie, type, (unsigned int)(frame->depth - start - 1));
+    if (!node) {
+        return NULL;
+    }
+    memcpy(node_prefix(trie, node), loader->key + start + 1, node->prefix_len);
+    node->has_value = frame->has_value;
+    node->value = frame->value;
+    for (i = 0; i < frame->num_children; i++) {
+        add_child(trie, &node, frame->key[i], frame->child[i]);
+    }
+    frame->num_children = 0;
+    refresh_max_value(trie, node);
+    
+    return node;
+}
+
+/**
+ * @brief Add the keys of a part of a parallel build to the trie of the part.
+ *
+ * @param[in, out] arg Pointer to the part.
+ *
+ * @return NULL, the outcome is left in the part.
+ */
+static void *build_trie_part (void *arg)
+{
+    trie_part_t *part;
+    size_t i, key;
+    
+    part = (trie_part_t *)arg;
+    part->result = TRUE;
+    for (i = part->start; i < part->end; i++) {
+        key = part->order[i];
+        if (!add_to_trie_len(part->keys[key], part->sizes[key], part->values[key], part->trie)) {
+            part->result = FALSE;
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Move the children of the root of a trie built on the side into a
+ * trie and free what is left of it.
+ *
+ * @details
+ * The children must not be taken in the trie yet. The arena of the trie built
+ * on the side, if there is one, is merged into the arena of the trie, so the
+ * nodes are released along with it.
+ *
+ * @param[in, out] trie Pointer to the trie.
+ * @param[in] part Pointer to the trie built on the side, with the same alphabet
+ *            and an arena only if the trie has one.
+ */
+static void adopt_trie (trie_t *trie, trie_t *part)
+{
+    node_t **child_ref;
+    unsigned char index;
+    
+    for (child_ref = next_child(part, part->child, 0, &index); child_ref;
+         child_ref = next_child(part, part->child, index + 1, &index)) {
+        add_child(trie, &trie->child, index, *child_ref);
+    }
+    free_node(part, part->child);
+    if (part->arena) {
+        merge_arena(trie->arena, part->arena);
+    }
+    free(part->path);
+    free(part);
+}
+
+/**
+ * @brief Find the child of a state of an Aho-Corasick automaton for a key
+ * index.
+ *
+ * @param[in] ac Pointer to the automaton.
+ * @param[in] state Index of the state.
+ * @param[in] index The key index.
+ * @param[out] child Index of the child.
+ *
+ * @return Boolean indicating if there is such a child or not.
+ */
+static boolean find_ac_child (aho_corasick_t *ac, uint32_t state, unsigned char index,
+                              uint32_t *child)
+{
+    uint32_t low, high, mid;
+    
+    low = ac->states[state].first_child;
+    high = low + ac->states[state].num_children;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (ac->labels[mid] < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if ((low == ac->states[state].first_child + ac->states[state].num_children) ||
+        (ac->labels[low] != index)) {
+        return FALSE;
+    }
+    *child = low;
+    
+    return TRUE;
+}
 
 /**
- * @brief An individual element of the trie.
+ * @brief Make sure the rows of a fuzzy search have room for a key.
  *
- * @details
- * A node with in each level of the trie that contains a character from the key 
- * and points to the next level of the trie. If the element contains a value, it
- * is so marked and the value stored.
+ * @param[in, out] fuzzy Pointer to the cursor.
+ * @param[in] key_len Length of the key.
+ *
+ * @return Boolean indicating if we succeeded or not.
  */
-typedef struct node_s {
-    struct node_s *child[NUM_CHILD];  /**< Pointers to the next level of trie. */
-    char key;                         /**< Character of the key at this level. */
-    int value;                        /**< Value stored for a particular key. */
-    boolean has_value;                /**< Boolean indicating if a value is stored or
-                                           this node has no value and is just part of
-                                           the chain to reach the next level. */
-} node_t;
+static boolean reserve_fuzzy_rows (trie_fuzzy_t *fuzzy, size_t key_len)
+{
+    unsigned int *rows;
+    size_t num_rows;
+    
+    if (key_len < fuzzy->num_rows) {
+        return TRUE;
+    }
+    for (num_rows = fuzzy->num_rows * 2; num_rows <= key_len; num_rows *= 2) {
+        ;
+    }
+    rows = (unsigned int *)realloc(fuzzy->rows,
+                                   sizeof(unsigned int) * num_rows * (fuzzy->query_len + 1));
+    if (!rows) {
+        return FALSE;
+    }
+    fuzzy->rows = rows;
+    fuzzy->num_rows = num_rows;
+    
+    return TRUE;
+}
 
 /**
- * @brief Trie data structure.
+ * @brief Work out the rows of a fuzzy search for the characters on the way to
+ * a child, up to the end of its prefix.
  *
  * @details
- * A trie data structure contains multiple levels. The first level contains 26
- * elements to accomodate all 26 possible english alphabet characters. Each of
- * these 26 characters can point to 26 elements at the second level to represent
- * all possible second characters of keys.
- */
-struct trie_s {
-    node_t *child;                     /**< Pointer to the node that will point level
-                                        of the trie. */
-};
-
-/*
- * Forward declarations.
- */
-static boolean key_permitted (char *);
-static unsigned char key_to_index (char);
-static boolean node_has_multiple_children (node_t *);
-static boolean node_has_children (node_t *node);
-
-/**
- * @brief Create the trie data structure.
+ * Each row follows from the one before with the usual Levenshtein recurrence.
+ * The distance between the query and any key that starts with the characters
+ * so far is at least the smallest distance of the row, so there is no point
+ * going on once it is more than the largest distance.
+ * The characters are added to the key. There must be room for them and their
+ * rows.
  *
- * @details.
- * Allocate the memory for trie and the child node that 
- * point to level 1.
+ * @param[in, out] fuzzy Pointer to the cursor.
+ * @param[in] node Pointer to the child.
+ * @param[in] index Key index on the edge to the child.
+ * @param[in] key_len Length of the key of the parent.
  *
- * @return Pointer to trie or NULL if memory allocation failed.
+ * @return Boolean indicating if keys at or below the child may still be close
+ * enough to the query.
  */
-trie_t *create_trie (void)
+static boolean fuzzy_rows (trie_fuzzy_t *fuzzy, node_t *node, unsigned char index,
+                           size_t key_len)
 {
     trie_t *trie;
+    unsigned char *prefix;
+    unsigned int *row, *prev;
+    unsigned int best, cost;
+    size_t width, i, j;
+    unsigned char ch;
     
-    trie = (trie_t *) malloc (sizeof(trie_t));
-    
-    if (trie) {
-        trie->child = (node_t *)malloc(sizeof(node_t));
-        if (!trie->child) {
-            free(trie);
-            
-            return NULL;
+    trie = fuzzy->trie;
+    prefix = node_prefix(trie, node);
+    width = fuzzy->query_len + 1;
+    for (i = 0; i <= node->prefix_len; i++) {
+        ch = i ? prefix[i - 1] : index;
+        fuzzy->key[key_len + i] = trie->index_to_char[ch];
+        prev = fuzzy->rows + (key_len + i) * width;
+        row = prev + width;
+        row[0] = prev[0] + 1;
+        best = row[0];
+        for (j = 1; j < width; j++) {
+            cost = prev[j - 1] + ((fuzzy->query[j - 1] == ch) ? 0 : 1);
+            if (prev[j] + 1 < cost) {
+                cost = prev[j] + 1;
+            }
+            if (row[j - 1] + 1 < cost) {
+                cost = row[j - 1] + 1;
+            }
+            row[j] = cost;
+            if (cost < best) {
+                best = cost;
+            }
+        }
+        if (best > fuzzy->max_distance) {
+            return FALSE;
         }
-        memset(trie->child, 0, sizeof(node_t));
     }
     
-    return trie;
+    return TRUE;
 }
 
 /**
- * @brief Add a value with a particular key.
- *
- * @details
- * Create chains or reuse ones that already exist to put elements
- * with all key characters at subsequent levels in the trie data
- * structure.
+ * @brief Put a node on the stack of a fuzzy search.
  *
- * @param[in] key The key provided to us.
- * @param[in] value Value corresponding to the key.
- * @param[in] trie Pointer to the trie.
+ * @param[in, out] fuzzy Pointer to the cursor.
+ * @param[in] node Pointer to the node.
+ * @param[in] key_len Length of the key of the node.
  *
  * @return Boolean indicating if we succeeded or not.
  */
-boolean add_to_trie (char *key, int value, trie_t *trie)
+static boolean fuzzy_push (trie_fuzzy_t *fuzzy, node_t *node, size_t key_len)
 {
-    if ((trie == NULL) || !key_permitted(key)) {
-        return FALSE;
-    }
+    iter_frame_t *stack;
     
-    unsigned int size_of_key;
+    if (fuzzy->depth == fuzzy->stack_size) {
+        stack = (iter_frame_t *)realloc(fuzzy->stack,
+                                        sizeof(iter_frame_t) * fuzzy->stack_size * 2);
+        if (!stack) {
+            return FALSE;
+        }
+        fuzzy->stack = stack;
+        fuzzy->stack_size *= 2;
+    }
+    fuzzy->stack[fuzzy->depth].node = node;
+    fuzzy->stack[fuzzy->depth].next = -1;
+    fuzzy->stack[fuzzy->depth].key_len = key_len;
+    fuzzy->depth++;
     
-    size_of_key = strlen(key);
-    node_t *node;
+    return TRUE;
+}
+
+/**
+ * @brief Turn a pattern into elements.
+ *
+ * @param[in] trie Pointer to the trie.
+ * @param[in] pattern The pattern, see trie_pattern_search().
+ * @param[in] size_of_pattern Number of characters in the pattern.
+ * @param[out] elements The elements, enough for a character each.
+ * @param[out] num_elements Number of elements.
+ *
+ * @return Boolean indicating if the pattern is valid or not.
+ */
+static boolean compile_pattern (trie_t *trie, const char *pattern, size_t size_of_pattern,
+                                pattern_element_t *elements, size_t *num_elements)
+{
+    pattern_element_t *element;
+    unsigned short index, last;
+    boolean negated;
+    size_t i, j;
+    unsigned char ch;
     
-    node = trie->child;
-    for (int i = 0; i < size_of_key; i++) {
-        if (node->child[key_to_index(key[i])] == NULL) {
-            node->child[key_to_index(key[i])] = (node_t *) malloc (sizeof(node_t));
-            if (!node->child[key_to_index(key[i])]) {
+    *num_elements = 0;
+    for (i = 0; i < size_of_pattern; i++) {
+        element = &elements[(*num_elements)++];
+        memset(element, 0, sizeof(pattern_element_t));
+        ch = (unsigned char)pattern[i];
+        if ((ch == '?') || (ch == '*')) {
+            for (index = 0; index < trie->alphabet_size; index++) {
+                element->matches[index / 64] |= (uint64_t)1 << (index % 64);
+            }
+            element->any_length = (ch == '*') ? TRUE : FALSE;
+            continue;
+        }
+        if (ch != '[') {
+            if ((ch == '\\') && (++i == size_of_pattern)) {
                 return FALSE;
             }
-            node = node->child[key_to_index(key[i])];
-            memset(node, 0, sizeof(node_t));
-            node->key = key[i];
-        } else {
-            node = node->child[key_to_index(key[i])];
+            index = key_to_index(trie, pattern[i]);
+            if (index != INVALID_INDEX) {
+                element->matches[index / 64] |= (uint64_t)1 << (index % 64);
+            }
+            continue;
         }
         
+        /*
+         * A class, a ']' right at the start is one of its characters.
+         */
+        i++;
+        negated = FALSE;
+        if ((i < size_of_pattern) && ((pattern[i] == '^') || (pattern[i] == '!'))) {
+            negated = TRUE;
+            i++;
+        }
+        for (j = i; (j < size_of_pattern) && ((j == i) || (pattern[j] != ']')); j++) {
+            ch = (unsigned char)pattern[j];
+            last = ch;
+            if ((j + 2 < size_of_pattern) && (pattern[j + 1] == '-') && (pattern[j + 2] != ']')) {
+                last = (unsigned char)pattern[j + 2];
+                j += 2;
+            }
+            for (; ch <= last; ch++) {
+                index = trie->char_to_index[ch];
+                if (index != INVALID_INDEX) {
+                    element->matches[index / 64] |= (uint64_t)1 << (index % 64);
+                }
+                if (ch == UCHAR_MAX) {
+                    break;
+                }
+            }
+        }
+        if (j == size_of_pattern) {
+            return FALSE;
+        }
+        if (negated) {
+            for (index = 0; index < trie->alphabet_size; index++) {
+                element->matches[index / 64] ^= (uint64_t)1 << (index % 64);
+            }
+        }
+        i = j;
     }
-    node->value = value;
-    node->has_value = TRUE;
     
     return TRUE;
 }
 
 /**
- * @brief Lookup the value stored for a particular key in the trie.
+ * @brief Add the positions of a pattern that are reached without a character
+ * to a row, those after elements of any length.
  *
- * @details
- * Traverse each level of the trie according to the characters in the 
- * key are return the value stored at the last level.
+ * @param[in] search Pointer to the cursor.
+ * @param[in, out] row The row.
+ */
+static void close_pattern_row (trie_pattern_t *search, uint64_t *row)
+{
+    size_t i;
+    
+    for (i = 0; i < search->num_elements; i++) {
+        if ((row[i / 64] & ((uint64_t)1 << (i % 64))) && search->elements[i].any_length) {
+            row[(i + 1) / 64] |= (uint64_t)1 << ((i + 1) % 64);
+        }
+    }
+}
+
+/**
+ * @brief Make sure the rows of a pattern search have room for a key.
  *
- * @param[in] trie Pointer to trie.
- * @param[in] key  The key supplied to us.
- * @param[out] value The value stored in the trie for this key.
+ * @param[in, out] search Pointer to the cursor.
+ * @param[in] key_len Length of the key.
  *
- * @return Boolean indicating whether the lookup succeded of failed.
+ * @return Boolean indicating if we succeeded or not.
  */
-boolean lookup_in_trie (trie_t *trie, char *key, int *value)
+static boolean reserve_pattern_rows (trie_pattern_t *search, size_t key_len)
 {
-    if (!key_permitted(key)) {
-        return FALSE;
-    }
-    
-    node_t *node;
-    unsigned int size_of_key;
+    uint64_t *rows;
+    size_t num_rows;
     
-    size_of_key = strlen(key);
-    node = trie->child;
-    for (int i = 0; i < size_of_key; i++) {
-        if (!node->child[key_to_index(key[i])]) {
-            return FALSE;
-        }
-        node = node->child[key_to_index(key[i])];
+    if (key_len < search->num_rows) {
+        return TRUE;
     }
-    if (!node->has_value) {
+    for (num_rows = search->num_rows * 2; num_rows <= key_len; num_rows *= 2) {
+        ;
+    }
+    rows = (uint64_t *)realloc(search->rows, sizeof(uint64_t) * num_rows * search->row_words);
+    if (!rows) {
         return FALSE;
     }
-    *value = node->value;
+    search->rows = rows;
+    search->num_rows = num_rows;
     
     return TRUE;
 }
 
 /**
- * @brief Delete the value stored in the trie for a particular key.
+ * @brief Work out the rows of a pattern search for the characters on the way
+ * to a child, up to the end of its prefix.
  *
  * @details
- * Delete the chain elements for a key if they are only supporting the 
- * value to be deleted. We do so by deleting all the nodes starting at 
- * end all way to a node that either has a value with it or has other 
- * children (supporting other keys).
+ * A position goes on to the next one with a character its element matches,
+ * or stays where it is if the element is of any length. The characters are
+ * added to the key. There must be room for them and their rows.
  *
- * @param[in] trie Poitner to trie.
- * @param[in] key The key supplied to us.
+ * @param[in, out] search Pointer to the cursor.
+ * @param[in] node Pointer to the child.
+ * @param[in] index Key index on the edge to the child.
+ * @param[in] key_len Length of the key of the parent.
  *
- * @return Boolean indicating if we deleted the key, value pair or not.
+ * @return Boolean indicating if keys at or below the child may still match the
+ * pattern.
  */
-boolean delete_from_trie (trie_t *trie, char *key)
+static boolean pattern_rows (trie_pattern_t *search, node_t *node, unsigned char index,
+                             size_t key_len)
 {
-    node_t *node;
-    node_t **nodes_to_be_deleted;
-    int index_of_last_node_with_value, starting_index_being_freed;
-    boolean index_being_freed_changed;
-    
-    if (!key_permitted(key)) {
-        return FALSE;
-    }
-    
-    int size_of_key, i;
-    
-    size_of_key = strlen(key);
-    node = trie->child;
-    nodes_to_be_deleted = (node_t **)malloc(sizeof(node_t) * size_of_key);
-    if (nodes_to_be_deleted == NULL) {
-        return FALSE;
-    }
+    trie_t *trie;
+    pattern_element_t *element;
+    unsigned char *prefix;
+    uint64_t *row, *prev;
+    uint64_t any;
+    size_t i, j, w;
+    unsigned char ch;
     
-    /*
-     * Assignign -1, so that in case where we don't see a node with value in
-     * the chain we go on deleting till 0.
-     */
-    index_of_last_node_with_value = -1;
-    index_being_freed_changed = TRUE;
-    for (i = 0; i < size_of_key; i++) {
-        /*
-         * Logic to determine starting_index_being_freed's value -
-         * Case 1 - Assume we run into no nodes that are important. In this case, we
-         *          want our index to be the key's first character.
-         *          index_being_freed_changed will turn TRUE in the last interation
-         *          of the for loop but we won't get to the body of for loop. The index
-         *          will be the one we encountered during the first iteration of the 
-         *          for loop.
-         * Case 2 - If we run into a node with a value in the middle,
-         *          index_being_freed_changed will help us get the correct value
-         *          in the next iteration of the for loop.
-         */
-        if (index_being_freed_changed) {
-            starting_index_being_freed = key_to_index(key[i]);
-            index_being_freed_changed = FALSE;
+    trie = search->trie;
+    prefix = node_prefix(trie, node);
+    for (i = 0; i <= node->prefix_len; i++) {
+        ch = i ? prefix[i - 1] : index;
+        search->key[key_len + i] = trie->index_to_char[ch];
+        prev = search->rows + (key_len + i) * search->row_words;
+        row = prev + search->row_words;
+        memset(row, 0, sizeof(uint64_t) * search->row_words);
+        for (j = 0; j < search->num_elements; j++) {
+            element = &search->elements[j];
+            if (!(prev[j / 64] & ((uint64_t)1 << (j % 64))) ||
+                !(element->matches[ch / 64] & ((uint64_t)1 << (ch % 64)))) {
+                continue;
+            }
+            w = element->any_length ? j : j + 1;
+            row[w / 64] |= (uint64_t)1 << (w % 64);
         }
-        if (!node->child[key_to_index(key[i])]) {
-            goto error_handling;
+        close_pattern_row(search, row);
+        for (any = 0, w = 0; w < search->row_words; w++) {
+            any |= row[w];
         }
-        node = node->child[key_to_index(key[i])];
-        nodes_to_be_deleted[i] = node;
-        if ((node->has_value || node_has_multiple_children (node)) && (i != (size_of_key - 1))) {
-            index_of_last_node_with_value = i;
-            index_being_freed_changed = TRUE;
+        if (!any) {
+            return FALSE;
         }
-        
-    }
-    if (!node->has_value) {
-        goto error_handling;
     }
     
-    /* 
-     * Handle the case where the last element for this key is supporting other elements.
-     */
-    if (node_has_children(node)) {
-        node->has_value = FALSE;
-        node->value = 0;
-    } else {
-        for (i = size_of_key - 1; i > index_of_last_node_with_value; i--) {
-            free (nodes_to_be_deleted[i]);
+    return TRUE;
+}
+
+/**
+ * @brief Put a node on the stack of a pattern search.
+ *
+ * @details
+ * The key indices the children may have are those matched by the elements
+ * at the positions of the row of the node.
+ *
+ * @param[in, out] search Pointer to the cursor.
+ * @param[in] node Pointer to the node.
+ * @param[in] key_len Length of the key of the node.
+ *
+ * @return Boolean indicating if we succeeded or not.
+ */
+static boolean pattern_push (trie_pattern_t *search, node_t *node, size_t key_len)
+{
+    pattern_frame_t *stack, *frame;
+    uint64_t *row;
+    size_t i, w;
+    
+    if (search->depth == search->stack_size) {
+        stack = (pattern_frame_t *)realloc(search->stack,
+                                           sizeof(pattern_frame_t) * search->stack_size * 2);
+        if (!stack) {
+            return FALSE;
         }
-        /*
-         * Handle the case where the entire chain is goig away.
-         */
-        if (index_of_last_node_with_value < 0) {
-            trie->child->child[starting_index_being_freed] = NULL;
-        } else {
-            nodes_to_be_deleted[i]->child[starting_index_being_freed] = NULL;
+        search->stack = stack;
+        search->stack_size *= 2;
+    }
+    frame = &search->stack[search->depth++];
+    frame->node = node;
+    frame->next = -1;
+    frame->key_len = key_len;
+    memset(frame->mask, 0, sizeof(frame->mask));
+    row = search->rows + key_len * search->row_words;
+    for (i = 0; i < search->num_elements; i++) {
+        if (row[i / 64] & ((uint64_t)1 << (i % 64))) {
+            for (w = 0; w < PATTERN_MASK_WORDS; w++) {
+                frame->mask[w] |= search->elements[i].matches[w];
+            }
         }
-        free(nodes_to_be_deleted);
     }
     
     return TRUE;
-    
-error_handling:
-    free(nodes_to_be_deleted);
-    return FALSE;
-    
 }
 
 /**
- * @brief Are the characters of of the key permitted?
- * 
- * @param[in] key The key supplied to us.
- * 
- * @return Boolean indicating if the key is ok or not.
+ * @brief Find the first key index in a mask at or after a key index.
+ *
+ * @param[in] mask The mask.
+ * @param[in] from The key index to start from.
+ *
+ * @return The key index or MAX_NUM_CHILD if there is none.
  */
-static boolean key_permitted (char *key)
+static int next_mask_index (const uint64_t *mask, int from)
 {
-    unsigned int size_of_key;
+    uint64_t bits;
+    int word;
     
-    size_of_key = strlen(key);
-    for (int i = 0; i < size_of_key; i++) {
-        if ((key[i] >= 'a') && (key[i] <= 'z')) {
-            continue;
-        } else {
-            return FALSE;
+    if (from >= MAX_NUM_CHILD) {
+        return MAX_NUM_CHILD;
+    }
+    word = from / 64;
+    bits = mask[word] & (~(uint64_t)0 << (from % 64));
+    while (!bits) {
+        if (++word == PATTERN_MASK_WORDS) {
+            return MAX_NUM_CHILD;
         }
+        bits = mask[word];
     }
     
-    return TRUE;
+    return word * 64 + __builtin_ctzll(bits);
 }
 
 /**
- * @brief Destory the trie, deallocating the assosciate memory.
- * 
- * @note
- * It is expected that all the children of the trie have been deleted.
- * A different implementation may go and delete all the elements via 
- * BFS/DFS too but this doesn't.
+ * @brief Create an arena.
  *
- * @param[in, out] trie Pointer to the trie data structure.
+ * @param[in] slab_size Usable bytes in each slab.
+ *
+ * @return Pointer to the arena or NULL if memory allocation failed.
  */
-void destroy_trie (trie_t *trie)
+static arena_t *create_arena (size_t slab_size)
 {
-    node_t *node;
-    
-    node = trie->child;
+    arena_t *arena;
     
-    for (int i = 0; i < NUM_CHILD; i++) {
-        assert(node->child[i] == NULL);
+    arena = (arena_t *)malloc(sizeof(arena_t));
+    if (arena) {
+        memset(arena, 0, sizeof(arena_t));
+        /*
+         * A slab has to fit at least the biggest block handed out of slabs.
+         */
+        if (slab_size < ARENA_MAX_BLOCK) {
+            slab_size = ARENA_MAX_BLOCK;
+        }
+        arena->slab_size = (slab_size + ARENA_GRANULE - 1) & ~(size_t)(ARENA_GRANULE - 1);
     }
     
-    free(trie->child);
-    free(trie);
+    return arena;
 }
 
-
 /**
- * @brief Convert this character to the index of element.
- * @param[in] ch  Character supplied.
- * @return Index to find the corresponding element in the trie.
+ * @brief Release an arena and every block ever handed out of it.
+ *
+ * @param[in] arena Pointer to the arena.
  */
-static unsigned char key_to_index (char ch)
+static void destroy_arena (arena_t *arena)
 {
-    return (ch - 'a');
+    slab_t *slab;
+    big_block_t *big_block;
+    
+    while (arena->slabs) {
+        slab = arena->slabs;
+        arena->slabs = slab->next;
+        free(slab);
+    }
+    while (arena->big_blocks) {
+        big_block = arena->big_blocks;
+        arena->big_blocks = big_block->link.next;
+        free(big_block);
+    }
+    free(arena);
 }
 
-
 /**
- * @brief Determine if this node has more than one children.
+ * @brief Allocate a block out of an arena.
  *
- * @param[in] node Reference to the node.
- * 
- * @return TRUE if this node has more than one children, FALSE otherwise.
+ * @details
+ * Recycle a free block of the same rounded size if there is one, otherwise
+ * carve a new one out of the current slab, starting a new slab if the current
+ * one is used up. What is left of the old slab goes on the free list for its size.
+ * Blocks bigger than ARENA_MAX_BLOCK are allocated on their own and linked to
+ * the arena so they can still be released along with it.
+ *
+ * @param[in] arena Pointer to the arena.
+ * @param[in] size Size of the block in bytes.
+ *
+ * @return Pointer to the block or NULL if memory allocation failed.
  */
-static boolean node_has_multiple_children (node_t *node)
+static void *arena_alloc (arena_t *arena, size_t size)
 {
-    unsigned int num_of_children;
+    size_t granules, left;
+    slab_t *slab;
+    big_block_t *big_block;
+    free_block_t *block;
     
-    if (!node) {
-        return FALSE;
+    if (size > ARENA_MAX_BLOCK) {
+        big_block = (big_block_t *)malloc(sizeof(big_block_t) + size);
+        if (!big_block) {
+            return NULL;
+        }
+        big_block->link.prev = NULL;
+        big_block->link.next = arena->big_blocks;
+        if (arena->big_blocks) {
+            arena->big_blocks->link.prev = big_block;
+        }
+        arena->big_blocks = big_block;
+        
+        return (big_block + 1);
     }
-    num_of_children = 0;
-    for (int i = 0; i < NUM_CHILD; i++) {
-        if (node->child[i]) {
-            num_of_children++;
-            if (num_of_children > 1) {
-                return TRUE;
-            }
+    
+    granules = (size + ARENA_GRANULE - 1) / ARENA_GRANULE;
+    if (arena->free_list[granules]) {
+        block = arena->free_list[granules];
+        arena->free_list[granules] = block->next;
+        
+        return block;
+    }
+    
+    if ((size_t)(arena->end - arena->next) < granules * ARENA_GRANULE) {
+        slab = (slab_t *)malloc(sizeof(slab_t) + arena->slab_size);
+        if (!slab) {
+            return NULL;
         }
+        left = arena->end - arena->next;
+        if (left >= ARENA_GRANULE) {
+            arena_free(arena, arena->next, left);
+        }
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        arena->next = (char *)(slab + 1);
+        arena->end = arena->next + arena->slab_size;
     }
+    block = (free_block_t *)arena->next;
+    arena->next += granules * ARENA_GRANULE;
     
-    return FALSE;
+    return block;
 }
 
 /**
- * @brief Determine if this node has any children.
+ * @brief Give a block back to the arena it came out of.
  *
- * @param[in] node Reference to the node.
+ * @param[in] arena Pointer to the arena.
+ * @param[in] block Pointer to the block.
+ * @param[in] size Size of the block in bytes, as passed to arena_alloc.
+ */
+static void arena_free (arena_t *arena, void *block, size_t size)
+{
+    size_t granules;
+    big_block_t *big_block;
+    free_block_t *free_block;
+    
+    if (size > ARENA_MAX_BLOCK) {
+        big_block = (big_block_t *)block - 1;
+        if (big_block->link.prev) {
+            big_block->link.prev->link.next = big_block->link.next;
+        } else {
+            arena->big_blocks = big_block->link.next;
+        }
+        if (big_block->link.next) {
+            big_block->link.next->link.prev = big_block->link.prev;
+        }
+        free(big_block);
+        
+        return;
+    }
+    
+    granules = (size + ARENA_GRANULE - 1) / ARENA_GRANULE;
+    free_block = (free_block_t *)block;
+    free_block->next = arena->free_list[granules];
+    arena->free_list[granules] = free_block;
+}
+
+/**
+ * @brief Hand everything of an arena over to another arena and free it.
  *
- * @return TRUE if this node has any children, FALSE otherwise.
+ * @details
+ * Blocks handed out of either arena can then be given back to the one that
+ * is left and are released along with it. What is left of the current slab of
+ * the smaller one is made a free block if it fits in one.
+ *
+ * @param[in, out] arena Pointer to the arena that is left.
+ * @param[in] other Pointer to the arena that is freed.
  */
-static boolean node_has_children (node_t *node)
+static void merge_arena (arena_t *arena, arena_t *other)
 {
-    if (!node) {
-        return FALSE;
+    slab_t *slab;
+    big_block_t *big_block;
+    free_block_t *block;
+    char *next;
+    size_t left, i;
+    
+    if (other->end - other->next > arena->end - arena->next) {
+        next = arena->next;
+        left = arena->end - arena->next;
+        arena->next = other->next;
+        arena->end = other->end;
+    } else {
+        next = other->next;
+        left = other->end - other->next;
     }
-    for (int i = 0; i < NUM_CHILD; i++) {
-        if (node->child[i]) {
-            return TRUE;
-        }
+    if ((left >= ARENA_GRANULE) && (left <= ARENA_MAX_BLOCK)) {
+        arena_free(arena, next, left);
     }
     
-    return FALSE;
+    if (other->slabs) {
+        for (slab = other->slabs; slab->next; slab = slab->next) {
+            ;
+        }
+        slab->next = arena->slabs;
+        arena->slabs = other->slabs;
+    }
+    if (other->big_blocks) {
+        for (big_block = other->big_blocks; big_block->link.next;
+             big_block = big_block->link.next) {
+            ;
+        }
+        big_block->link.next = arena->big_blocks;
+        if (arena->big_blocks) {
+            arena->big_blocks->link.prev = big_block;
+        }
+        arena->big_blocks = other->big_blocks;
+    }
+    for (i = 0; i < ARENA_NUM_CLASSES; i++) {
+        if (!other->free_list[i]) {
+            continue;
+        }
+        for (block = other->free_list[i]; block->next; block = block->next) {
+            ;
+        }
+        block->next = arena->free_list[i];
+        arena->free_list[i] = other->free_list[i];
+    }
+    free(other);
 }
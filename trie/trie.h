@@ -17,6 +17,8 @@
 #ifndef _TRIE_H_
 #define _TRIE_H_
 
+#include <stddef.h>
+
 
 /**
  * @brief Enum representing a boolean.
@@ -26,11 +28,94 @@ typedef enum bool {
     TRUE
 }boolean;
 typedef struct trie_s trie_t;
+typedef struct trie_iter_s trie_iter_t;
+typedef struct trie_snapshot_s trie_snapshot_t;
+typedef struct mapped_trie_s mapped_trie_t;
+typedef struct frozen_trie_s frozen_trie_t;
+typedef struct frozen_iter_s frozen_iter_t;
+typedef struct louds_trie_s louds_trie_t;
+typedef struct louds_iter_s louds_iter_t;
+typedef struct double_array_trie_s double_array_trie_t;
+typedef struct trie_loader_s trie_loader_t;
+typedef struct aho_corasick_s aho_corasick_t;
+typedef struct aho_corasick_scan_s aho_corasick_scan_t;
+typedef struct trie_fuzzy_s trie_fuzzy_t;
+typedef struct trie_pattern_s trie_pattern_t;
+
+/*
+ * Alphabets for create_trie_with_alphabet.
+ */
+#define TRIE_ALPHABET_LOWERCASE "abcdefghijklmnopqrstuvwxyz"
+#define TRIE_ALPHABET_DNA "ACGT"
+#define TRIE_ALPHABET_HEX "0123456789abcdef"
+#define TRIE_ALPHABET_BYTES NULL
 
 boolean add_to_trie (char *, int, trie_t *);
 boolean delete_from_trie (trie_t *, char *);
 boolean lookup_in_trie (trie_t *, char *, int *value);
+boolean add_to_trie_len (const char *, size_t, int, trie_t *);
+boolean delete_from_trie_len (trie_t *, const char *, size_t);
+boolean lookup_in_trie_len (trie_t *, const char *, size_t, int *value);
+void lookup_batch_in_trie (trie_t *, const char **, const size_t *, size_t, int *values,
+                           boolean *found);
+boolean longest_prefix_match (trie_t *, const char *, size_t, int *value, size_t *match_len);
+void longest_prefix_match_batch (trie_t *, const char **, const size_t *, size_t, int *values,
+                                 size_t *match_lens, boolean *found);
 trie_t *create_trie (void);
+trie_t *create_trie_with_arena (unsigned int);
+trie_t *create_trie_with_alphabet (const char *, boolean);
+trie_t *create_concurrent_trie (const char *);
+trie_t *create_persistent_trie (const char *);
 void destroy_trie (trie_t *);
+void clear_trie (trie_t *);
+trie_snapshot_t *trie_snapshot (trie_t *);
+boolean lookup_in_snapshot (trie_snapshot_t *, const char *, size_t, int *value);
+void trie_snapshot_release (trie_snapshot_t *);
+trie_iter_t *trie_iter_prefix (trie_t *, const char *, size_t);
+boolean trie_iter_next (trie_iter_t *, char *key, size_t, size_t *key_len, int *value);
+void trie_iter_destroy (trie_iter_t *);
+boolean top_k_in_trie (trie_t *, const char *, size_t, size_t k, char *keys, size_t,
+                       size_t *key_lens, int *values, size_t *num_found);
+boolean save_trie (trie_t *, const char *path);
+mapped_trie_t *open_mapped_trie (const char *path);
+boolean lookup_in_mapped_trie (mapped_trie_t *, const char *, size_t, int *value);
+void close_mapped_trie (mapped_trie_t *);
+frozen_trie_t *freeze_trie (trie_t *);
+boolean lookup_in_frozen_trie (frozen_trie_t *, const char *, size_t, int *value);
+void destroy_frozen_trie (frozen_trie_t *);
+frozen_iter_t *frozen_trie_iter_prefix (frozen_trie_t *, const char *, size_t);
+boolean frozen_trie_iter_next (frozen_iter_t *, char *key, size_t, size_t *key_len,
+                               int *value);
+void frozen_trie_iter_destroy (frozen_iter_t *);
+louds_trie_t *build_louds_trie (trie_t *);
+boolean lookup_in_louds_trie (louds_trie_t *, const char *, size_t, int *value);
+void destroy_louds_trie (louds_trie_t *);
+louds_iter_t *louds_trie_iter_prefix (louds_trie_t *, const char *, size_t);
+boolean louds_trie_iter_next (louds_iter_t *, char *key, size_t, size_t *key_len,
+                              int *value);
+void louds_trie_iter_destroy (louds_iter_t *);
+double_array_trie_t *build_double_array_trie (trie_t *);
+double_array_trie_t *build_double_array_from_keys (const char *, const char **, const size_t *,
+                                                   const int *values, size_t);
+boolean lookup_in_double_array_trie (double_array_trie_t *, const char *, size_t, int *value);
+void destroy_double_array_trie (double_array_trie_t *);
+trie_loader_t *trie_loader_create (trie_t *);
+boolean trie_loader_add (trie_loader_t *, const char *, size_t, int);
+boolean trie_loader_finish (trie_loader_t *);
+boolean build_trie_parallel (trie_t *, const char **, const size_t *, const int *values, size_t,
+                             unsigned int num_threads);
+aho_corasick_t *build_aho_corasick (trie_t *);
+void destroy_aho_corasick (aho_corasick_t *);
+aho_corasick_scan_t *aho_corasick_scan_create (aho_corasick_t *);
+void aho_corasick_scan_feed (aho_corasick_scan_t *, const char *, size_t);
+boolean aho_corasick_scan_next (aho_corasick_scan_t *, size_t *end, size_t *key_len, int *value);
+void aho_corasick_scan_destroy (aho_corasick_scan_t *);
+trie_fuzzy_t *trie_fuzzy_search (trie_t *, const char *, size_t, unsigned int max_distance);
+boolean trie_fuzzy_next (trie_fuzzy_t *, char *key, size_t, size_t *key_len, int *value,
+                         unsigned int *distance);
+void trie_fuzzy_destroy (trie_fuzzy_t *);
+trie_pattern_t *trie_pattern_search (trie_t *, const char *, size_t);
+boolean trie_pattern_next (trie_pattern_t *, char *key, size_t, size_t *key_len, int *value);
+void trie_pattern_destroy (trie_pattern_t *);
 
 #endif /* _TRIE_H_ */